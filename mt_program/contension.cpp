@@ -1,164 +1,654 @@
 #include <stdio.h>
 #include <thread>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
 #include <time.h>
-#include </home/pakalapati/snipersim/include/sim_api.h>
+
+#include "kernels.h"
+#include "locks.h"
+#include "roi.h"
+#include "thread_pool.h"
 
 #define DIMENSION 5000
 
+// usage: contension [-l mutex|ttas|ticket|mcs|atomic] [-t threads]
+//                   [-c critical section] [-n elements] [-r rounds]
+//                   [-k kernel] [-d dimension] [-b tile]
+//                   [-s static|dynamic|stealing] [-g chunk]
+//
+// Every round starts <threads> threads that compute <elements> elements of
+// arrayC = arrayA * arrayB between them. A thread takes the next element
+// under the lock and computes the first <critical section> products of its
+// dot product before releasing it, the rest outside. The default, the whole
+// dot product under a std::mutex and one element per thread, is the
+// original workload. -l atomic takes elements with a fetch-add and no lock.
+//
+// -k naive|contiguous|transposed|tiled|simd runs the compute-bound baseline
+// instead: the whole product with one of the kernels of kernels.h, the rows
+// split evenly between the threads, checked against the naive result.
+// -d sets the matrix dimension, -b the tile size of the tiled kernel.
+//
+// -s computes the whole product on a pool of <threads> persistent workers
+// with the given scheduling, in chunks of -g items: rows of the kernel
+// with -k, otherwise single elements (dot products). The workers are
+// started before the ROI, so it holds only the work and the scheduling.
+
 using std::thread;
 using std::mutex;
 
+enum LockType
+{
+    LOCK_MUTEX,
+    LOCK_TTAS,
+    LOCK_TICKET,
+    LOCK_MCS,
+    LOCK_ATOMIC
+};
+
+static const char *lockNames[] = { "mutex", "ttas", "ticket", "mcs", "atomic" };
+
+enum KernelType
+{
+    KERNEL_NONE,
+    KERNEL_NAIVE,
+    KERNEL_CONTIGUOUS,
+    KERNEL_TRANSPOSED,
+    KERNEL_TILED,
+    KERNEL_SIMD
+};
+
+static const char *kernelNames[] = { "none", "naive", "contiguous", "transposed", "tiled", "simd" };
+
+KernelType kernelType = KERNEL_NONE;
+
+int dimension = DIMENSION;
+
+int tileSize = 64;
+
+bool usePool = false;
+
+Schedule schedule = SCHEDULE_STATIC;
+
+// -1: 16 rows with a kernel, 64 elements without
+long chunkSize = -1;
+
+LockType lockType = LOCK_MUTEX;
+
+int numThreads = 3;
+
+// clamped to dimension once the options are read
+int criticalSection = -1;
+
+long elementsPerRound = -1;
+
+int rounds = 9;
+
 mutex lock;
+TtasLock ttasLock;
+TicketLock ticketLock;
+McsLock mcsLock;
 
 int **arrayA;
 int **arrayB;
 int **arrayC;
 
-int counter = 0;
+// single row-major allocations for the kernels, and B transposed
+int *flatA;
+int *flatB;
+int *flatBt;
+int *flatC;
+
+// next element, taken under the lock
+long counter = 0;
 
-void samuel_start_roi()
+// next element, for -l atomic
+alignas(CACHE_LINE) std::atomic<long> atomicCounter(0);
+
+// elements of the current round are below this
+long roundEnd = 0;
+
+// products [from, to) of the dot product for element
+static int dotProduct(long element, int from, int to)
 {
-    printf("Start ROI\n");
+    int column = element % dimension;
+    int row = (element / dimension) % dimension;
+
+    unsigned tmpp = 0;
+
+    for (int i = from; i < to; i++)
+    {
+        tmpp = tmpp + (unsigned)arrayA[row][i] * (unsigned)arrayB[i][column];
+    }
+
+    return (int)tmpp;
 }
 
-void samuel_end_roi()
+static void storeElement(long element, int value)
 {
-    printf("End ROI\n");
+    int column = element % dimension;
+    int row = (element / dimension) % dimension;
+
+    arrayC[row][column] = value;
 }
 
-void matrixMultiplication()
+template <class Lock>
+void lockedWorker(Lock &l)
 {
-    lock.lock();
+    while (true)
+    {
+        l.lock();
+
+        long element = counter;
+
+        if (element >= roundEnd)
+        {
+            l.unlock();
+            return;
+        }
 
-    int column = counter % DIMENSION;
-    int row = (counter - column) / DIMENSION;
+        counter++;
 
-    int tmpp = 0;
+        int tmpp = dotProduct(element, 0, criticalSection);
 
-    for (int i = 0; i < DIMENSION; i++)
-    {        
-        tmpp = tmpp + arrayA[row][i] * arrayB[i][column];              
+        l.unlock();
+
+        tmpp = (int)((unsigned)tmpp + (unsigned)dotProduct(element, criticalSection, dimension));
+
+        storeElement(element, tmpp);
     }
+}
+
+void atomicWorker()
+{
+    while (true)
+    {
+        long element = atomicCounter.fetch_add(1);
 
-    arrayC[row][column] = tmpp;
-    
-    counter++;
+        if (element >= roundEnd)
+        {
+            return;
+        }
 
-    lock.unlock();
+        storeElement(element, dotProduct(element, 0, dimension));
+    }
+}
 
-    if (counter >= (DIMENSION * DIMENSION - 1))
+void matrixMultiplication()
+{
+    switch (lockType)
     {
-        return;
+        case LOCK_MUTEX:  lockedWorker(lock); break;
+        case LOCK_TTAS:   lockedWorker(ttasLock); break;
+        case LOCK_TICKET: lockedWorker(ticketLock); break;
+        case LOCK_MCS:    lockedWorker(mcsLock); break;
+        case LOCK_ATOMIC: atomicWorker(); break;
+    }
+}
+
+// make the next elementsPerRound elements available, before the threads start
+void startRound()
+{
+    // the last round handed out everything below roundEnd
+    atomicCounter.store(roundEnd);
+    roundEnd += elementsPerRound;
+}
+
+void runRound()
+{
+    startRound();
+
+    std::vector<thread> threads;
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        threads.push_back(thread(matrixMultiplication));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
     }
-    
 }
 
 void spawnThreads()
 {
-    thread t1(matrixMultiplication);
-    thread t2(matrixMultiplication);
-    thread t3(matrixMultiplication);
-    
-    t1.join();
-    t2.join();
-    t3.join();    
+    runRound();
 }
 
 void sample_this()
 {
-    thread t1(matrixMultiplication);
-    thread t2(matrixMultiplication);
-    thread t3(matrixMultiplication);
-    
-    t1.join();
-    t2.join();
-    t3.join();    
+    runRound();
+}
+
+// rows [rowBegin, rowEnd) with the selected kernel
+void runKernel(int rowBegin, int rowEnd)
+{
+    switch (kernelType)
+    {
+        case KERNEL_NAIVE:      naiveKernel(arrayA, arrayB, arrayC, dimension, rowBegin, rowEnd); break;
+        case KERNEL_CONTIGUOUS: contiguousKernel(flatA, flatB, flatC, dimension, rowBegin, rowEnd); break;
+        case KERNEL_TRANSPOSED: transposedKernel(flatA, flatBt, flatC, dimension, rowBegin, rowEnd); break;
+        case KERNEL_TILED:      tiledKernel(flatA, flatB, flatC, dimension, rowBegin, rowEnd, tileSize); break;
+        case KERNEL_SIMD:       simdKernel(flatA, flatB, flatC, dimension, rowBegin, rowEnd); break;
+        default: break;
+    }
+}
+
+void kernelThread(int index)
+{
+    long rows = dimension;
+
+    runKernel(rows * index / numThreads, rows * (index + 1) / numThreads);
 }
 
-int main() 
+int resultElement(int row, int column)
 {
-    printf("Multi-threaded application for matrix multiplication with contension.\n");   
-    
-    printf("Lock memory location: %lx\n", (unsigned long)&lock);
+    return ((kernelType == KERNEL_NAIVE) || (kernelType == KERNEL_NONE)) ? arrayC[row][column] : flatC[(size_t)row * dimension + column];
+}
+
+// Compare with naive dot products, every row of small matrices and
+// CHECK_ROWS rows spread over large ones. Returns the number of mismatches.
+#define CHECK_ROWS 16
+
+long checkKernel()
+{
+    int step = (dimension <= 1024) ? 1 : dimension / CHECK_ROWS;
+    long mismatches = 0;
+
+    for (int row = 0; row < dimension; row += step)
+    {
+        for (int column = 0; column < dimension; column++)
+        {
+            long element = (long)row * dimension + column;
+
+            if (resultElement(row, column) != dotProduct(element, 0, dimension))
+            {
+                if (mismatches == 0)
+                {
+                    printf("Mismatch at row %d column %d\n", row, column);
+                }
+                mismatches++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+void reportCheck(long mismatches)
+{
+    if (mismatches != 0)
+    {
+        printf("Check failed: %ld elements differ from the naive result\n", mismatches);
+    }
+    else
+    {
+        printf("Check passed\n");
+    }
+}
+
+void prepareKernel()
+{
+    size_t size = (size_t)dimension * dimension;
+
+    if ((kernelType == KERNEL_NAIVE) || (kernelType == KERNEL_NONE))
+    {
+        return;
+    }
+
+    flatA = new int[size];
+    flatB = new int[size];
+    flatC = new int[size];
+    flatBt = (kernelType == KERNEL_TRANSPOSED) ? new int[size] : NULL;
+
+    for (int i = 0; i < dimension; i++)
+    {
+        memcpy(flatA + (size_t)i * dimension, arrayA[i], dimension * sizeof(int));
+        memcpy(flatB + (size_t)i * dimension, arrayB[i], dimension * sizeof(int));
+
+        if (flatBt != NULL)
+        {
+            for (int j = 0; j < dimension; j++)
+            {
+                flatBt[(size_t)j * dimension + i] = arrayB[i][j];
+            }
+        }
+    }
+}
+
+// the whole product in the ROI, returns the process exit code
+int kernelMain()
+{
+    prepareKernel();
+
+    RoiStart();
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    std::vector<thread> threads;
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        threads.push_back(thread(kernelThread, i));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    RoiEnd();
+
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    double macs = (double)dimension * dimension * dimension;
+
+    printf("ROI: kernel %s, %dx%d in %.6f s, %.3f GMAC/s\n",
+        kernelNames[kernelType], dimension, dimension, seconds, seconds > 0 ? macs / seconds / 1e9 : 0.0);
+
+    long mismatches = checkKernel();
+    reportCheck(mismatches);
+
+    delete[] flatA;
+    delete[] flatB;
+    delete[] flatBt;
+    delete[] flatC;
+
+    return (mismatches == 0) ? 0 : 1;
+}
+
+// the whole product on the pool, returns the process exit code
+int poolMain()
+{
+    prepareKernel();
+
+    long items = (kernelType != KERNEL_NONE) ? dimension : (long)dimension * dimension;
+
+    if (chunkSize < 1)
+    {
+        chunkSize = (kernelType != KERNEL_NONE) ? 16 : 64;
+    }
+
+    ThreadPool::Body body;
+
+    if (kernelType != KERNEL_NONE)
+    {
+        body = [](long begin, long end) { runKernel((int)begin, (int)end); };
+    }
+    else
+    {
+        body = [](long begin, long end)
+        {
+            for (long element = begin; element < end; element++)
+            {
+                storeElement(element, dotProduct(element, 0, dimension));
+            }
+        };
+    }
+
+    ThreadPool pool(numThreads);
+
+    RoiStart();
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    pool.run(items, chunkSize, schedule, body);
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    RoiEnd();
+
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    double macs = (double)dimension * dimension * dimension;
+
+    printf("ROI: %s schedule, chunks of %ld %s, %dx%d in %.6f s, %.3f GMAC/s\n",
+        scheduleNames[schedule], chunkSize, (kernelType != KERNEL_NONE) ? "rows" : "elements",
+        dimension, dimension, seconds, seconds > 0 ? macs / seconds / 1e9 : 0.0);
+
+    for (size_t i = 0; i < pool.workerStats().size(); i++)
+    {
+        const ThreadPool::Stats &stats = pool.workerStats()[i];
+
+        printf("  worker %zu: %ld chunks, %ld items, %ld steals\n", i, stats.chunks, stats.items, stats.steals);
+    }
+
+    long mismatches = checkKernel();
+    reportCheck(mismatches);
+
+    delete[] flatA;
+    delete[] flatB;
+    delete[] flatBt;
+    delete[] flatC;
+
+    return (mismatches == 0) ? 0 : 1;
+}
+
+// the lock-bound workload: warm-up rounds, then the timed rounds in the ROI
+void contentionMain()
+{
+    // warm-up, outside the ROI
+    for (int i = 0; i < 3; i++)
+    {
+        spawnThreads();
+    }
+
+    for (int i = 0; i < 7; i++)
+    {
+        sample_this();
+    }
+
+    RoiStart();
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < rounds; i++)
+    {
+        sample_this();
+    }
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    RoiEnd();
+
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    long elements = elementsPerRound * rounds;
+
+    printf("ROI: %ld elements in %.6f s, %.1f elements/s, %.3f GMAC/s\n",
+        elements, seconds, seconds > 0 ? elements / seconds : 0.0,
+        seconds > 0 ? (double)elements * dimension / seconds / 1e9 : 0.0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-l mutex|ttas|ticket|mcs|atomic] [-t threads] [-c critical section] [-n elements] [-r rounds]\n"
+                    "       [-k naive|contiguous|transposed|tiled|simd] [-d dimension] [-b tile]\n"
+                    "       [-s static|dynamic|stealing] [-g chunk]\n", name);
+}
+
+static bool parseOptions(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:t:c:n:r:k:d:b:s:g:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+            {
+                bool found = false;
+
+                for (int i = 0; i <= LOCK_ATOMIC; i++)
+                {
+                    if (strcmp(optarg, lockNames[i]) == 0)
+                    {
+                        lockType = (LockType)i;
+                        found = true;
+                    }
+                }
+
+                if (!found)
+                {
+                    return false;
+                }
+                break;
+            }
+            case 'k':
+            {
+                bool found = false;
+
+                for (int i = KERNEL_NAIVE; i <= KERNEL_SIMD; i++)
+                {
+                    if (strcmp(optarg, kernelNames[i]) == 0)
+                    {
+                        kernelType = (KernelType)i;
+                        found = true;
+                    }
+                }
+
+                if (!found)
+                {
+                    return false;
+                }
+                break;
+            }
+            case 's':
+            {
+                bool found = false;
+
+                for (int i = SCHEDULE_STATIC; i <= SCHEDULE_STEALING; i++)
+                {
+                    if (strcmp(optarg, scheduleNames[i]) == 0)
+                    {
+                        schedule = (Schedule)i;
+                        found = true;
+                    }
+                }
+
+                if (!found)
+                {
+                    return false;
+                }
+
+                usePool = true;
+                break;
+            }
+            case 'g': chunkSize = atol(optarg); break;
+            case 'd': dimension = atoi(optarg); break;
+            case 'b': tileSize = atoi(optarg); break;
+            case 't': numThreads = atoi(optarg); break;
+            case 'c': criticalSection = atoi(optarg); break;
+            case 'n': elementsPerRound = atol(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default: return false;
+        }
+    }
+
+    if ((numThreads < 1) || (rounds < 0) || (dimension < 1) || (tileSize < 1))
+    {
+        return false;
+    }
+
+    if ((criticalSection < 0) || (criticalSection > dimension))
+    {
+        criticalSection = dimension;
+    }
+
+    if (elementsPerRound < 0)
+    {
+        elementsPerRound = numThreads;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!parseOptions(argc, argv))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("Multi-threaded application for matrix multiplication with contension.\n");
+
+    if (usePool)
+    {
+        printf("Pool of %d threads, %s schedule, kernel %s, dimension %d\n",
+            numThreads, scheduleNames[schedule], kernelType != KERNEL_NONE ? kernelNames[kernelType] : "dot product", dimension);
+    }
+    else if (kernelType != KERNEL_NONE)
+    {
+        printf("Kernel %s, %d threads, dimension %d\n", kernelNames[kernelType], numThreads, dimension);
+    }
+    else
+    {
+        printf("Lock %s, %d threads, critical section %d of %d products, %ld elements per round, %d rounds\n",
+            lockNames[lockType], numThreads, lockType == LOCK_ATOMIC ? 0 : criticalSection, dimension, elementsPerRound, rounds);
+
+        switch (lockType)
+        {
+            case LOCK_MUTEX:  printf("Lock memory location: %lx\n", (unsigned long)&lock); break;
+            case LOCK_TTAS:   printf("Lock memory location: %lx\n", (unsigned long)&ttasLock); break;
+            case LOCK_TICKET: printf("Lock memory location: %lx\n", (unsigned long)&ticketLock); break;
+            case LOCK_MCS:    printf("Lock memory location: %lx\n", (unsigned long)&mcsLock); break;
+            case LOCK_ATOMIC: printf("Counter memory location: %lx\n", (unsigned long)&atomicCounter); break;
+        }
+    }
 
     // init
-    arrayA = new int*[DIMENSION];
-    arrayB = new int*[DIMENSION];
-    arrayC = new int*[DIMENSION];
+    arrayA = new int*[dimension];
+    arrayB = new int*[dimension];
+    arrayC = new int*[dimension];
 
-    for (int i = 0; i < DIMENSION; i++)
+    for (int i = 0; i < dimension; i++)
     {
-        arrayA[i] = new int[DIMENSION];
-        arrayB[i] = new int[DIMENSION];
-        arrayC[i] = new int[DIMENSION];
+        arrayA[i] = new int[dimension];
+        arrayB[i] = new int[dimension];
+        arrayC[i] = new int[dimension];
     }
 
     // set values
     srand (time(NULL));
 
-    for (int i = 0; i < DIMENSION; i++)
+    for (int i = 0; i < dimension; i++)
     {
-        for (int j = 0; j < DIMENSION; j++)
+        for (int j = 0; j < dimension; j++)
         {
             arrayA[i][j] = rand() % 1000;
-        }        
+        }
     }
 
-    for (int i = 0; i < DIMENSION; i++)
+    for (int i = 0; i < dimension; i++)
     {
-        for (int j = 0; j < DIMENSION; j++)
+        for (int j = 0; j < dimension; j++)
         {
             arrayB[i][j] = rand() % 1000;
-        }        
-    }
-
-    thread t1(spawnThreads);
-    thread t2(spawnThreads);
-    thread t3(spawnThreads);
-    
-    t1.join();
-    t2.join();
-    t3.join();
-
-// for(int i=0; i<1000; i++)
-//    {
-//     thread t1(spawnThreads);
-//     thread t2(spawnThreads);
-//     thread t3(spawnThreads);
-    
-//     t1.join();
-//     t2.join();
-//     t3.join();
-//    }
-
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-
-// samuel_start_roi();
-SimRoiStart();
-
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-sample_this();
-
-// samuel_end_roi();
-SimRoiEnd();
+        }
+    }
+
+    int exitCode = 0;
+
+    if (usePool)
+    {
+        exitCode = poolMain();
+    }
+    else if (kernelType != KERNEL_NONE)
+    {
+        exitCode = kernelMain();
+    }
+    else
+    {
+        contentionMain();
+    }
 
     // free memory
-    for (int i = 0; i < DIMENSION; i++)
+    for (int i = 0; i < dimension; i++)
     {
         delete[] arrayA[i];
         delete[] arrayB[i];
@@ -171,5 +661,5 @@ SimRoiEnd();
 
     printf("Application exits!\n");
 
-    return 0;
+    return exitCode;
 }
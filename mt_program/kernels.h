@@ -0,0 +1,172 @@
+// Matrix multiplication kernels for the compute-bound baseline of the
+// workload. Every kernel computes rows [rowBegin, rowEnd) of the n x n
+// C = A * B, so the rows can be split between threads. Sums wrap around like
+// unsigned 32-bit integers, so all kernels give the same result whatever the
+// order of the additions.
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// the original layout: one allocation per row, B read down a column
+inline void naiveKernel(int **A, int **B, int **C, int n, int rowBegin, int rowEnd)
+{
+    for (int i = rowBegin; i < rowEnd; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            unsigned tmpp = 0;
+
+            for (int k = 0; k < n; k++)
+            {
+                tmpp += (unsigned)A[i][k] * (unsigned)B[k][j];
+            }
+
+            C[i][j] = (int)tmpp;
+        }
+    }
+}
+
+// same loops on single row-major allocations
+inline void contiguousKernel(const int *A, const int *B, int *C, int n, int rowBegin, int rowEnd)
+{
+    for (int i = rowBegin; i < rowEnd; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            unsigned tmpp = 0;
+
+            for (int k = 0; k < n; k++)
+            {
+                tmpp += (unsigned)A[i * n + k] * (unsigned)B[k * n + j];
+            }
+
+            C[i * n + j] = (int)tmpp;
+        }
+    }
+}
+
+// Bt is B transposed, so both operands are read along a row
+inline void transposedKernel(const int *A, const int *Bt, int *C, int n, int rowBegin, int rowEnd)
+{
+    for (int i = rowBegin; i < rowEnd; i++)
+    {
+        const int *a = A + (size_t)i * n;
+
+        for (int j = 0; j < n; j++)
+        {
+            const int *b = Bt + (size_t)j * n;
+            unsigned tmpp = 0;
+
+            for (int k = 0; k < n; k++)
+            {
+                tmpp += (unsigned)a[k] * (unsigned)b[k];
+            }
+
+            C[(size_t)i * n + j] = (int)tmpp;
+        }
+    }
+}
+
+// tile x tile blocks of A, B and C, i-k-j inside a block so B and C are read
+// along rows
+inline void tiledKernel(const int *A, const int *B, int *C, int n, int rowBegin, int rowEnd, int tile)
+{
+    for (int i = rowBegin; i < rowEnd; i++)
+    {
+        memset(C + (size_t)i * n, 0, n * sizeof(int));
+    }
+
+    for (int ii = rowBegin; ii < rowEnd; ii += tile)
+    {
+        int iEnd = (ii + tile < rowEnd) ? ii + tile : rowEnd;
+
+        for (int kk = 0; kk < n; kk += tile)
+        {
+            int kEnd = (kk + tile < n) ? kk + tile : n;
+
+            for (int jj = 0; jj < n; jj += tile)
+            {
+                int jEnd = (jj + tile < n) ? jj + tile : n;
+
+                for (int i = ii; i < iEnd; i++)
+                {
+                    unsigned *c = (unsigned *)(C + (size_t)i * n);
+
+                    for (int k = kk; k < kEnd; k++)
+                    {
+                        unsigned a = A[(size_t)i * n + k];
+                        const int *b = B + (size_t)k * n;
+
+                        for (int j = jj; j < jEnd; j++)
+                        {
+                            c[j] += a * (unsigned)b[j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// blocks of SIMD_K_BLOCK x SIMD_J_BLOCK of B, so the block stays in the L2
+// while the rows of A go by
+#define SIMD_K_BLOCK 128
+#define SIMD_J_BLOCK 512
+
+// i-k-j with the j loop in 8-lane AVX2 vectors, or left to the compiler's
+// auto-vectorizer without AVX2
+inline void simdKernel(const int *A, const int *B, int *C, int n, int rowBegin, int rowEnd)
+{
+    for (int i = rowBegin; i < rowEnd; i++)
+    {
+        memset(C + (size_t)i * n, 0, n * sizeof(int));
+    }
+
+    for (int kk = 0; kk < n; kk += SIMD_K_BLOCK)
+    {
+        int kEnd = (kk + SIMD_K_BLOCK < n) ? kk + SIMD_K_BLOCK : n;
+
+        for (int jj = 0; jj < n; jj += SIMD_J_BLOCK)
+        {
+            int jEnd = (jj + SIMD_J_BLOCK < n) ? jj + SIMD_J_BLOCK : n;
+
+            for (int i = rowBegin; i < rowEnd; i++)
+            {
+                unsigned *__restrict__ c = (unsigned *)(C + (size_t)i * n);
+
+                for (int k = kk; k < kEnd; k++)
+                {
+                    unsigned a = A[(size_t)i * n + k];
+                    const unsigned *__restrict__ b = (const unsigned *)(B + (size_t)k * n);
+                    int j = jj;
+
+#if defined(__AVX2__)
+                    __m256i va = _mm256_set1_epi32((int)a);
+
+                    for (; j + 8 <= jEnd; j += 8)
+                    {
+                        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+                        __m256i vc = _mm256_loadu_si256((const __m256i *)(c + j));
+
+                        vc = _mm256_add_epi32(vc, _mm256_mullo_epi32(va, vb));
+                        _mm256_storeu_si256((__m256i *)(c + j), vc);
+                    }
+#endif
+
+                    for (; j < jEnd; j++)
+                    {
+                        c[j] += a * b[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif // KERNELS_H
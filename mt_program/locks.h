@@ -0,0 +1,137 @@
+// Spin locks for the contention workload. All of them have lock() and
+// unlock(), so they work with std::lock_guard like std::mutex does.
+
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+#define CACHE_LINE 64
+
+// test-and-test-and-set: spin on a plain load, only try the exchange when
+// the lock looks free
+class alignas(CACHE_LINE) TtasLock
+{
+public:
+    void lock()
+    {
+        while (true)
+        {
+            while (locked.load(std::memory_order_relaxed))
+            {
+                cpu_relax();
+            }
+
+            if (!locked.exchange(true, std::memory_order_acquire))
+            {
+                return;
+            }
+        }
+    }
+
+    void unlock()
+    {
+        locked.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> locked{false};
+};
+
+// FIFO: take a ticket, wait until it is served
+class alignas(CACHE_LINE) TicketLock
+{
+public:
+    void lock()
+    {
+        unsigned ticket = next.fetch_add(1, std::memory_order_relaxed);
+
+        while (serving.load(std::memory_order_acquire) != ticket)
+        {
+            cpu_relax();
+        }
+    }
+
+    void unlock()
+    {
+        serving.store(serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::atomic<unsigned> next{0};
+
+    // on its own line, the waiters spin on it
+    alignas(CACHE_LINE) std::atomic<unsigned> serving{0};
+};
+
+// MCS queue lock: every waiter spins on its own node. The node is per
+// thread, so a thread may hold only one McsLock at a time.
+class alignas(CACHE_LINE) McsLock
+{
+public:
+    struct alignas(CACHE_LINE) Node
+    {
+        std::atomic<Node*> next{nullptr};
+        std::atomic<bool> waiting{false};
+    };
+
+    void lock()
+    {
+        Node *node = &myNode;
+
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->waiting.store(true, std::memory_order_relaxed);
+
+        Node *previous = tail.exchange(node, std::memory_order_acq_rel);
+
+        if (previous != nullptr)
+        {
+            previous->next.store(node, std::memory_order_release);
+
+            while (node->waiting.load(std::memory_order_acquire))
+            {
+                cpu_relax();
+            }
+        }
+    }
+
+    void unlock()
+    {
+        Node *node = &myNode;
+        Node *successor = node->next.load(std::memory_order_acquire);
+
+        if (successor == nullptr)
+        {
+            Node *expected = node;
+
+            if (tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+            {
+                return;
+            }
+
+            // a thread is queueing behind us, wait until it linked itself
+            while ((successor = node->next.load(std::memory_order_acquire)) == nullptr)
+            {
+                cpu_relax();
+            }
+        }
+
+        successor->waiting.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<Node*> tail{nullptr};
+
+    static thread_local Node myNode;
+};
+
+thread_local McsLock::Node McsLock::myNode;
+
+#endif // LOCKS_H
@@ -0,0 +1,72 @@
+// Region of interest markers: RoiStart() / RoiEnd() around the part of the
+// workload that is simulated. The backend is chosen at compile time with
+// -DROI_BACKEND=<backend>:
+//
+// ROI_PIN (default): calls to the functions tracer_roi_begin/tracer_roi_end,
+//     which the pintool finds by name (-roi 1). They do nothing otherwise,
+//     so the program runs anywhere.
+// ROI_SNIPER: Sniper's magic instruction, xchg %bx,%bx with the command in
+//     rax, as sim_api.h's SimRoiStart()/SimRoiEnd() do. The pintool also
+//     recognizes it. Only for x86.
+// ROI_NONE: no markers at all.
+
+#ifndef ROI_H
+#define ROI_H
+
+#define ROI_NONE   0
+#define ROI_PIN    1
+#define ROI_SNIPER 2
+
+#ifndef ROI_BACKEND
+#define ROI_BACKEND ROI_PIN
+#endif
+
+#if ROI_BACKEND == ROI_SNIPER
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "ROI_SNIPER needs an x86 target"
+#endif
+
+// sim_api.h: SIM_CMD_ROI_START, SIM_CMD_ROI_END
+#define ROI_SNIPER_START 1
+#define ROI_SNIPER_END   2
+
+static inline unsigned long roiSniperMagic(unsigned long command)
+{
+    unsigned long result;
+
+    __asm__ __volatile__ ("xchg %%bx, %%bx" : "=a" (result) : "a" (command) : "memory");
+
+    return result;
+}
+
+static inline void RoiStart() { roiSniperMagic(ROI_SNIPER_START); }
+static inline void RoiEnd() { roiSniperMagic(ROI_SNIPER_END); }
+
+#elif ROI_BACKEND == ROI_PIN
+
+// Weak so the header can be included in several files. noinline and the
+// empty asm keep the calls and the symbols in the binary.
+extern "C" __attribute__((noinline, weak)) void tracer_roi_begin()
+{
+    __asm__ __volatile__ ("" ::: "memory");
+}
+
+extern "C" __attribute__((noinline, weak)) void tracer_roi_end()
+{
+    __asm__ __volatile__ ("" ::: "memory");
+}
+
+static inline void RoiStart() { tracer_roi_begin(); }
+static inline void RoiEnd() { tracer_roi_end(); }
+
+#elif ROI_BACKEND == ROI_NONE
+
+static inline void RoiStart() {}
+static inline void RoiEnd() {}
+
+#else
+#error "unknown ROI_BACKEND"
+#endif
+
+#endif // ROI_H
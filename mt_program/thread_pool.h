@@ -0,0 +1,278 @@
+// Persistent worker threads for the workload. run() hands [0, items) to the
+// workers in chunks of <chunk> items and returns when all are done; the
+// threads stay up between runs.
+//
+// static:   every worker gets an equal, contiguous share up front
+// dynamic:  workers take the next chunk from a shared atomic counter
+// stealing: every worker starts with its static share in its own deque and
+//           takes chunks from the far end of other workers' deques once its
+//           own is empty
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "locks.h"
+
+enum Schedule
+{
+    SCHEDULE_STATIC,
+    SCHEDULE_DYNAMIC,
+    SCHEDULE_STEALING
+};
+
+static const char *scheduleNames[] = { "static", "dynamic", "stealing" };
+
+class ThreadPool
+{
+public:
+    // padded rather than aligned, vector does not honour over-alignment before C++17
+    struct Stats
+    {
+        long chunks;
+        long items;
+        long steals;
+
+        char _pad[CACHE_LINE - 3 * sizeof(long)];
+    };
+
+    typedef std::function<void(long, long)> Body;
+
+    explicit ThreadPool(int workers) : generation(0), running(0), stop(false), items(0), chunk(1),
+        schedule(SCHEDULE_STATIC), body(nullptr), queues(workers), stats(workers)
+    {
+        for (int i = 0; i < workers; i++)
+        {
+            threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        start.notify_all();
+
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+        }
+    }
+
+    // call body(begin, end) for every chunk of [0, totalItems), wait for all
+    void run(long totalItems, long chunkItems, Schedule how, const Body &work)
+    {
+        int workers = (int)threads.size();
+
+        items = totalItems;
+        chunk = (chunkItems > 0) ? chunkItems : 1;
+        schedule = how;
+        body = &work;
+        next.store(0);
+
+        for (int i = 0; i < workers; i++)
+        {
+            stats[i].chunks = 0;
+            stats[i].items = 0;
+            stats[i].steals = 0;
+
+            if (schedule == SCHEDULE_STEALING)
+            {
+                long begin, end;
+                share(i, begin, end);
+
+                for (long b = begin; b < end; b += chunk)
+                {
+                    queues[i].chunks.push_back(std::make_pair(b, (b + chunk < end) ? b + chunk : end));
+                }
+            }
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        running = workers;
+        generation++;
+        start.notify_all();
+
+        done.wait(guard, [this] { return running == 0; });
+    }
+
+    const std::vector<Stats>& workerStats() const { return stats; }
+
+private:
+    // the contiguous share of worker index
+    void share(int index, long &begin, long &end) const
+    {
+        long workers = (long)threads.size();
+
+        begin = items * index / workers;
+        end = items * (index + 1) / workers;
+    }
+
+    void execute(int index, long begin, long end)
+    {
+        (*body)(begin, end);
+
+        stats[index].chunks++;
+        stats[index].items += end - begin;
+    }
+
+    void runStatic(int index)
+    {
+        long begin, end;
+        share(index, begin, end);
+
+        for (long b = begin; b < end; b += chunk)
+        {
+            execute(index, b, (b + chunk < end) ? b + chunk : end);
+        }
+    }
+
+    void runDynamic(int index)
+    {
+        while (true)
+        {
+            long b = next.fetch_add(chunk);
+
+            if (b >= items)
+            {
+                return;
+            }
+
+            execute(index, b, (b + chunk < items) ? b + chunk : items);
+        }
+    }
+
+    bool take(int victim, bool own, std::pair<long, long> &range)
+    {
+        Queue &queue = queues[victim];
+        std::lock_guard<std::mutex> guard(queue.lock);
+
+        if (queue.chunks.empty())
+        {
+            return false;
+        }
+
+        // the owner works front to back, thieves take from the back
+        if (own)
+        {
+            range = queue.chunks.front();
+            queue.chunks.pop_front();
+        }
+        else
+        {
+            range = queue.chunks.back();
+            queue.chunks.pop_back();
+        }
+
+        return true;
+    }
+
+    void runStealing(int index)
+    {
+        int workers = (int)threads.size();
+        std::pair<long, long> range;
+
+        while (true)
+        {
+            if (take(index, true, range))
+            {
+                execute(index, range.first, range.second);
+                continue;
+            }
+
+            // no work is added during a run, one empty sweep means we are done
+            bool found = false;
+
+            for (int i = 1; (i < workers) && !found; i++)
+            {
+                found = take((index + i) % workers, false, range);
+            }
+
+            if (!found)
+            {
+                return;
+            }
+
+            stats[index].steals++;
+            execute(index, range.first, range.second);
+        }
+    }
+
+    void workerLoop(int index)
+    {
+        unsigned long seen = 0;
+
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+
+                start.wait(guard, [this, seen] { return stop || (generation != seen); });
+
+                if (stop)
+                {
+                    return;
+                }
+
+                seen = generation;
+            }
+
+            switch (schedule)
+            {
+                case SCHEDULE_STATIC:   runStatic(index); break;
+                case SCHEDULE_DYNAMIC:  runDynamic(index); break;
+                case SCHEDULE_STEALING: runStealing(index); break;
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (--running == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::pair<long, long> > chunks;
+
+        char _pad[CACHE_LINE];
+    };
+
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable done;
+
+    unsigned long generation;
+    int running;
+    bool stop;
+
+    // the current run, set before the workers are woken
+    long items;
+    long chunk;
+    Schedule schedule;
+    const Body *body;
+
+    alignas(CACHE_LINE) std::atomic<long> next;
+
+    std::vector<Queue> queues;
+
+    std::vector<Stats> stats;
+};
+
+#endif // THREAD_POOL_H
@@ -2,5 +2,5 @@ cd tracer/
 make
 cd ..
 cd scratch
-pin -t ../tracer/obj-intel64/pintool.so -o dependency.txt -- ../mt_program/contension.out
+pin -t ../tracer/obj-intel64/pintool.so -o dependency.jsonl -- ../mt_program/contension.out
 cd ..
\ No newline at end of file
@@ -1,6 +1,9 @@
 #!/bin/bash
 
-for (( index=0; index<=20; index++ ))
+# usage: ./attach_xz.sh [number of threads, default 21]
+COUNT=${1:-21}
+
+for (( index=0; index<COUNT; index++ ))
 do
     xz -0 -c "named_pipe_${index}" > compressed_${index}.xz &
-done
\ No newline at end of file
+done
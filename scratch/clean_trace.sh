@@ -1,6 +1,6 @@
-for (( index=0; index<=20; index++ ))
+for pipe in named_pipe_*
 do
-    rm "named_pipe_${index}"
+    [ -p "${pipe}" ] && rm "${pipe}"
 done
 
 rm *.txt
@@ -1,6 +1,11 @@
 #!/bin/bash
 
-for (( index=0; index<=20; index++ ))
+# usage: ./create_named_pipe.sh [number of threads, default 21]
+# The pintool creates any missing pipe itself, pre-creating them only lets
+# attach_xz.sh attach the readers up front.
+COUNT=${1:-21}
+
+for (( index=0; index<COUNT; index++ ))
 do
     mkfifo "named_pipe_${index}"
 done
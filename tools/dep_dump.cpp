@@ -0,0 +1,53 @@
+/*
+ * Print a thread dependency record (either -dep_format) as the table the
+ * pintool used to print at exit.
+ *
+ * usage: dep_dump <dependency file>
+ */
+
+#include <stdio.h>
+
+#include "dependency_reader.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <dependency file>\n", argv[0]);
+        return 1;
+    }
+
+    DependencyReader reader;
+
+    if ( ! reader.open(argv[1]))
+    {
+        fprintf(stderr, "Error: %s\n", reader.error().c_str());
+        return 1;
+    }
+
+    printf("Child Thread    Parent Thread    Thread Start    Thread Terminate    #Instructions Run\n");
+
+    for (size_t i = 0; i < reader.threads().size(); i++)
+    {
+        const ThreadDependency &t = reader.threads()[i];
+
+        if ( ! t.hasParent)
+        {
+            continue;
+        }
+
+        printf("%12llu    %13llu    %12llu    %16s    %17s\n",
+            (unsigned long long)t.thread, (unsigned long long)t.parent, (unsigned long long)t.startTime,
+            t.finished ? std::to_string((unsigned long long)t.terminateTime).c_str() : "-",
+            t.finished ? std::to_string((unsigned long long)t.insCount).c_str() : "-");
+    }
+
+    printf("Thread 0 instruction count %llu\n", (unsigned long long)reader.mainInstructions());
+
+    if ( ! reader.complete())
+    {
+        printf("Record is incomplete, the traced run did not exit normally.\n");
+    }
+
+    return 0;
+}
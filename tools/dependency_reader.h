@@ -0,0 +1,306 @@
+/*
+ * Reader for the thread dependency record written by the pintool (-o).
+ *
+ * Understands both -dep_format jsonl, which is written while the threads
+ * start and finish, and the text table written at exit by -dep_format text.
+ * A jsonl record of a run that crashed or was killed is still readable; the
+ * threads that never finished have finished == false.
+ *
+ * Thread numbers are the logical thread numbers <n> of the stream names.
+ */
+
+#ifndef DEPENDENCY_READER_H
+#define DEPENDENCY_READER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct ThreadDependency
+{
+    uint64_t thread;
+
+    // the main thread has no parent
+    bool hasParent;
+    uint64_t parent;
+
+    // instruction number of the parent when the thread started
+    uint64_t startTime;
+
+    bool finished;
+
+    // instruction number of the parent when the thread finished
+    uint64_t terminateTime;
+
+    // instructions executed by the thread
+    uint64_t insCount;
+
+    uint64_t pinTid;
+    uint64_t osTid;
+};
+
+class DependencyReader
+{
+  public:
+
+    DependencyReader() : complete_(false), mainInstructions_(0) {}
+
+    // returns false and sets error() if the file cannot be read
+    bool open(const std::string &fileName)
+    {
+        std::ifstream in(fileName.c_str());
+
+        if ( ! in)
+        {
+            error_ = "could not open " + fileName;
+            return false;
+        }
+
+        threads_.clear();
+        byThread_.clear();
+        complete_ = false;
+
+        std::string line;
+        unsigned lineNumber = 0;
+
+        while (std::getline(in, line))
+        {
+            lineNumber++;
+
+            size_t first = line.find_first_not_of(" \t\r");
+
+            if (first == std::string::npos)
+            {
+                continue;
+            }
+
+            bool ok = (line[first] == '{') ? parseJsonLine(line) : parseTextLine(line);
+
+            if ( ! ok)
+            {
+                std::ostringstream message;
+                message << fileName << ":" << lineNumber << ": malformed line";
+                error_ = message.str();
+                return false;
+            }
+        }
+
+        for (std::map<uint64_t, ThreadDependency>::const_iterator it = byThread_.begin(); it != byThread_.end(); ++it)
+        {
+            threads_.push_back(it->second);
+        }
+
+        return true;
+    }
+
+    // in thread number order
+    const std::vector<ThreadDependency>& threads() const { return threads_; }
+
+    const ThreadDependency* find(uint64_t thread) const
+    {
+        std::map<uint64_t, ThreadDependency>::const_iterator it = byThread_.find(thread);
+        return it == byThread_.end() ? NULL : &it->second;
+    }
+
+    // true if the record has its end marker, i.e. the run exited normally
+    bool complete() const { return complete_; }
+
+    uint64_t mainInstructions() const { return mainInstructions_; }
+
+    const std::string& error() const { return error_; }
+
+  private:
+
+    typedef std::map<std::string, std::string> Fields;
+
+    ThreadDependency& thread(uint64_t number)
+    {
+        ThreadDependency &t = byThread_[number];
+        t.thread = number;
+        return t;
+    }
+
+    // flat objects with string and unsigned integer values, as the tool writes them
+    static bool parseObject(const std::string &line, Fields &fields)
+    {
+        size_t pos = line.find('{');
+
+        while (true)
+        {
+            pos = line.find_first_not_of(" \t", pos + 1);
+
+            if ((pos == std::string::npos) || (line[pos] == '}'))
+            {
+                return pos != std::string::npos;
+            }
+
+            if (line[pos] != '"')
+            {
+                return false;
+            }
+
+            size_t keyEnd = line.find('"', pos + 1);
+            size_t colon = line.find(':', keyEnd);
+
+            if ((keyEnd == std::string::npos) || (colon == std::string::npos))
+            {
+                return false;
+            }
+
+            std::string key = line.substr(pos + 1, keyEnd - pos - 1);
+
+            size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+            size_t valueEnd;
+
+            if (valueStart == std::string::npos)
+            {
+                return false;
+            }
+
+            if (line[valueStart] == '"')
+            {
+                valueEnd = line.find('"', valueStart + 1);
+                if (valueEnd == std::string::npos)
+                {
+                    return false;
+                }
+                fields[key] = line.substr(valueStart + 1, valueEnd - valueStart - 1);
+                valueEnd++;
+            }
+            else
+            {
+                valueEnd = line.find_first_of(",}", valueStart);
+                if (valueEnd == std::string::npos)
+                {
+                    return false;
+                }
+                fields[key] = line.substr(valueStart, valueEnd - valueStart);
+            }
+
+            pos = line.find_first_not_of(" \t", valueEnd);
+
+            if ((pos == std::string::npos) || ((line[pos] != ',') && (line[pos] != '}')))
+            {
+                return false;
+            }
+
+            if (line[pos] == '}')
+            {
+                return true;
+            }
+        }
+    }
+
+    static bool number(const Fields &fields, const char *key, uint64_t &value)
+    {
+        Fields::const_iterator it = fields.find(key);
+
+        if (it == fields.end())
+        {
+            return false;
+        }
+
+        value = strtoull(it->second.c_str(), NULL, 10);
+        return true;
+    }
+
+    bool parseJsonLine(const std::string &line)
+    {
+        Fields fields;
+
+        if ( ! parseObject(line, fields))
+        {
+            return false;
+        }
+
+        const std::string &event = fields["event"];
+
+        if (event == "end")
+        {
+            complete_ = true;
+            number(fields, "main_instructions", mainInstructions_);
+            return true;
+        }
+
+        uint64_t number_;
+
+        if ( ! number(fields, "thread", number_))
+        {
+            return false;
+        }
+
+        ThreadDependency &t = thread(number_);
+
+        t.hasParent = number(fields, "parent", t.parent);
+
+        if (event == "start")
+        {
+            number(fields, "start", t.startTime);
+            number(fields, "pin_tid", t.pinTid);
+            number(fields, "os_tid", t.osTid);
+        }
+        else if (event == "finish")
+        {
+            t.finished = true;
+            number(fields, "terminate", t.terminateTime);
+            number(fields, "instructions", t.insCount);
+
+            if (t.thread == 0)
+            {
+                mainInstructions_ = t.insCount;
+            }
+        }
+
+        return true;
+    }
+
+    // rows of the -dep_format text table, everything else is decoration
+    bool parseTextLine(const std::string &line)
+    {
+        std::istringstream row(line);
+        uint64_t values[5];
+
+        for (int i = 0; i < 5; i++)
+        {
+            if ( ! (row >> values[i]))
+            {
+                if (line.compare(0, 27, "Thread 0 instruction count ") == 0)
+                {
+                    mainInstructions_ = strtoull(line.c_str() + 27, NULL, 10);
+                }
+                else if (line.compare(0, 8, "The end!") == 0)
+                {
+                    complete_ = true;
+                }
+                return true;
+            }
+        }
+
+        ThreadDependency &t = thread(values[0]);
+        t.hasParent = true;
+        t.parent = values[1];
+        t.startTime = values[2];
+        t.terminateTime = values[3];
+        t.insCount = values[4];
+        t.finished = true;
+
+        return true;
+    }
+
+    std::vector<ThreadDependency> threads_;
+
+    std::map<uint64_t, ThreadDependency> byThread_;
+
+    bool complete_;
+
+    uint64_t mainInstructions_;
+
+    std::string error_;
+};
+
+#endif // DEPENDENCY_READER_H
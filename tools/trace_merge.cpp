@@ -0,0 +1,423 @@
+/*
+ * Merge the per-thread traces of one run into a single interleaved trace.
+ *
+ * usage: trace_merge -d <dependency file> -o <output> [-q <quantum>]
+ *                    [-c <chunk records>] [-t] <trace files...>
+ *
+ * The threads are interleaved round robin, <quantum> records (default 1) at
+ * a time. The dependency record keeps the order the run had: a thread starts
+ * once its parent has emitted the instructions it ran before the thread was
+ * created (start), and a parent does not run past the instruction at which
+ * the thread finished (terminate) before the thread has emitted all of its
+ * records. Record i of a trace is taken to be instruction i of its thread,
+ * so the traces should be full traces (no -skip / -trace_length window).
+ * Marker records (-clock) are not instructions and are left out.
+ *
+ * The thread number of a trace is the first number in its file name
+ * (trace_<n>, compressed_<n>.xz, trace_<n>_<OS tid>.zst). Compressed traces
+ * are decoded on one thread each, in parallel with the merge; plain traces
+ * are memory-mapped.
+ *
+ * -t also writes <output>.tid, the thread number of every output record as a
+ * uint32.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "dependency_reader.h"
+#include "trace_reader.h"
+
+struct MergeThread
+{
+    uint64_t number;
+
+    const ThreadDependency *dependency;
+
+    MergeThread *parent;
+
+    TraceInput *input;
+
+    // current chunk of the input
+    const trace_instr_format_t *records;
+    size_t available;
+
+    // records written so far
+    uint64_t emitted;
+
+    bool exhausted;
+
+    // finished children by terminate time, the next one that can hold us
+    std::vector<MergeThread*> children;
+    size_t childCursor;
+};
+
+static bool TerminatesEarlier(const MergeThread *a, const MergeThread *b)
+{
+    return a->dependency->terminateTime < b->dependency->terminateTime;
+}
+
+class OutputFile
+{
+  public:
+
+    OutputFile() : file_(NULL) {}
+
+    bool open(const std::string &path)
+    {
+        file_ = fopen(path.c_str(), "wb");
+        buffer_.reserve(1 << 20);
+        return file_ != NULL;
+    }
+
+    void write(const void *data, size_t size)
+    {
+        const char *bytes = static_cast<const char*>(data);
+
+        if (buffer_.size() + size > buffer_.capacity())
+        {
+            flush();
+        }
+
+        if (size >= buffer_.capacity())
+        {
+            fwrite(bytes, 1, size, file_);
+            return;
+        }
+
+        buffer_.insert(buffer_.end(), bytes, bytes + size);
+    }
+
+    bool close()
+    {
+        flush();
+        bool ok = ! ferror(file_);
+        return (fclose(file_) == 0) && ok;
+    }
+
+  private:
+
+    void flush()
+    {
+        if ( ! buffer_.empty())
+        {
+            fwrite(&buffer_[0], 1, buffer_.size(), file_);
+            buffer_.clear();
+        }
+    }
+
+    FILE *file_;
+
+    std::vector<char> buffer_;
+};
+
+static void Usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -d <dependency file> -o <output> [-q <quantum>] [-c <chunk records>] [-t] <trace files...>\n", name);
+}
+
+// false if the thread has not started yet or waits for a child to finish
+static bool Runnable(MergeThread *t)
+{
+    if ((t->parent != NULL) && ! t->parent->exhausted && (t->parent->emitted < t->dependency->startTime))
+    {
+        return false;
+    }
+
+    while ((t->childCursor < t->children.size()) && t->children[t->childCursor]->exhausted)
+    {
+        t->childCursor++;
+    }
+
+    if (t->childCursor < t->children.size())
+    {
+        return t->emitted < t->children[t->childCursor]->dependency->terminateTime;
+    }
+
+    return true;
+}
+
+// how many records t may write now, at most max
+static uint64_t Allowance(const MergeThread *t, uint64_t max)
+{
+    if (t->childCursor < t->children.size())
+    {
+        uint64_t limit = t->children[t->childCursor]->dependency->terminateTime - t->emitted;
+        return std::min(max, limit);
+    }
+
+    return max;
+}
+
+// write up to count records of t, returns the number written
+static uint64_t Emit(MergeThread *t, uint64_t count, size_t chunkRecords, OutputFile &out, OutputFile *tidOut)
+{
+    uint64_t written = 0;
+
+    while ((written < count) && ! t->exhausted)
+    {
+        if (t->available == 0)
+        {
+            t->available = t->input->next(&t->records, chunkRecords);
+
+            if (t->available == 0)
+            {
+                if ( ! t->input->error().empty())
+                {
+                    fprintf(stderr, "Error: %s\n", t->input->error().c_str());
+                    exit(1);
+                }
+
+                t->exhausted = true;
+                break;
+            }
+        }
+
+        size_t n = std::min<uint64_t>(t->available, count - written);
+
+        // the instructions up to the next marker record, which is dropped
+        size_t run = 0;
+        while ((run < n) && ! IsMarkerRecord(t->records + run))
+        {
+            run++;
+        }
+
+        out.write(t->records, run * sizeof(trace_instr_format_t));
+
+        if (tidOut != NULL)
+        {
+            uint32_t number = t->number;
+            for (size_t i = 0; i < run; i++)
+            {
+                tidOut->write(&number, sizeof(number));
+            }
+        }
+
+        size_t consumed = (run < n) ? run + 1 : run;
+
+        t->records += consumed;
+        t->available -= consumed;
+        t->emitted += run;
+        written += run;
+    }
+
+    return written;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string dependencyFile;
+    std::string outputFile;
+    uint64_t quantum = 1;
+    size_t chunkRecords = 1 << 16;
+    bool writeTids = false;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:o:q:c:t")) != -1)
+    {
+        switch (opt)
+        {
+          case 'd': dependencyFile = optarg; break;
+          case 'o': outputFile = optarg; break;
+          case 'q': quantum = strtoull(optarg, NULL, 10); break;
+          case 'c': chunkRecords = strtoull(optarg, NULL, 10); break;
+          case 't': writeTids = true; break;
+          default: Usage(argv[0]); return 1;
+        }
+    }
+
+    if (dependencyFile.empty() || outputFile.empty() || (optind == argc) || (quantum == 0) || (chunkRecords == 0))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    DependencyReader dependencies;
+
+    if ( ! dependencies.open(dependencyFile))
+    {
+        fprintf(stderr, "Error: %s\n", dependencies.error().c_str());
+        return 1;
+    }
+
+    // the main thread is not a row of the text table
+    ThreadDependency mainThread = ThreadDependency();
+
+    std::map<uint64_t, MergeThread*> threads;
+
+    for (int i = optind; i < argc; i++)
+    {
+        long long number = ThreadNumberFromPath(argv[i]);
+
+        if (number < 0)
+        {
+            fprintf(stderr, "Error: no thread number in the file name %s\n", argv[i]);
+            return 1;
+        }
+
+        if (threads.count(number) != 0)
+        {
+            fprintf(stderr, "Error: two traces for thread %lld\n", number);
+            return 1;
+        }
+
+        std::string error;
+        TraceInput *input = TraceInput::open(argv[i], error);
+
+        if (input == NULL)
+        {
+            fprintf(stderr, "Error: %s\n", error.c_str());
+            return 1;
+        }
+
+        if (dynamic_cast<MappedInput*>(input) == NULL)
+        {
+            input = new PrefetchInput(input, chunkRecords, 4);
+        }
+
+        MergeThread *t = new MergeThread();
+        t->number = number;
+        t->input = input;
+        t->dependency = dependencies.find(number);
+
+        if (t->dependency == NULL)
+        {
+            if (number != 0)
+            {
+                fprintf(stderr, "Warning: thread %lld is not in the dependency record, it is merged without constraints\n", number);
+            }
+            t->dependency = &mainThread;
+        }
+
+        threads[number] = t;
+    }
+
+    for (std::map<uint64_t, MergeThread*>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        MergeThread *t = it->second;
+
+        if ( ! t->dependency->hasParent)
+        {
+            continue;
+        }
+
+        std::map<uint64_t, MergeThread*>::iterator parent = threads.find(t->dependency->parent);
+
+        if (parent == threads.end())
+        {
+            fprintf(stderr, "Warning: no trace for thread %llu, the parent of thread %llu\n",
+                (unsigned long long)t->dependency->parent, (unsigned long long)t->number);
+            continue;
+        }
+
+        t->parent = parent->second;
+
+        // a thread that never finished does not hold its parent
+        if (t->dependency->finished)
+        {
+            parent->second->children.push_back(t);
+        }
+    }
+
+    std::vector<MergeThread*> live;
+
+    for (std::map<uint64_t, MergeThread*>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        std::sort(it->second->children.begin(), it->second->children.end(), TerminatesEarlier);
+        live.push_back(it->second);
+    }
+
+    OutputFile out;
+    OutputFile tidOut;
+
+    if ( ! out.open(outputFile) || (writeTids && ! tidOut.open(outputFile + ".tid")))
+    {
+        fprintf(stderr, "Error: could not create %s\n", outputFile.c_str());
+        return 1;
+    }
+
+    uint64_t total = 0;
+    uint64_t relaxed = 0;
+
+    while ( ! live.empty())
+    {
+        bool progress = false;
+
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            MergeThread *t = live[i];
+
+            if (Runnable(t))
+            {
+                uint64_t n = Emit(t, Allowance(t, quantum), chunkRecords, out, writeTids ? &tidOut : NULL);
+                total += n;
+                progress = progress || (n > 0) || t->exhausted;
+            }
+        }
+
+        if ( ! progress)
+        {
+            // The traces do not match the record (cut-off trace, window), let
+            // the lowest numbered waiting thread run one quantum regardless.
+            MergeThread *t = live[0];
+            uint64_t n = Emit(t, quantum, chunkRecords, out, writeTids ? &tidOut : NULL);
+            total += n;
+
+            if (relaxed++ == 0)
+            {
+                fprintf(stderr, "Warning: the traces do not match the dependency record at thread %llu record %llu, "
+                    "ordering constraints were relaxed\n", (unsigned long long)t->number, (unsigned long long)t->emitted);
+            }
+        }
+
+        size_t kept = 0;
+
+        for (size_t i = 0; i < live.size(); i++)
+        {
+            if ( ! live[i]->exhausted)
+            {
+                live[kept++] = live[i];
+            }
+        }
+
+        live.resize(kept);
+    }
+
+    bool ok = out.close() && ( ! writeTids || tidOut.close());
+
+    if ( ! ok)
+    {
+        fprintf(stderr, "Error: could not write %s\n", outputFile.c_str());
+        return 1;
+    }
+
+    printf("Merged %llu records of %zu threads into %s\n", (unsigned long long)total, threads.size(), outputFile.c_str());
+
+    if (relaxed > 0)
+    {
+        printf("Ordering constraints were relaxed %llu times\n", (unsigned long long)relaxed);
+    }
+
+    for (std::map<uint64_t, MergeThread*>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        MergeThread *t = it->second;
+
+        if (t->dependency->finished && (t->dependency->insCount != t->emitted))
+        {
+            fprintf(stderr, "Warning: thread %llu has %llu records, the dependency record says %llu instructions\n",
+                (unsigned long long)t->number, (unsigned long long)t->emitted, (unsigned long long)t->dependency->insCount);
+        }
+
+        delete t->input;
+        delete t;
+    }
+
+    return 0;
+}
@@ -0,0 +1,582 @@
+/*
+ * Readers for the per-thread traces written by the pintool.
+ *
+ * A trace is a sequence of fixed-size trace_instr_format_t records, either
+ * plain (-sink file / fifo), or compressed as .xz or .zst. Plain files are
+ * memory-mapped, compressed ones are decoded in chunks. PrefetchInput runs
+ * the decoding of one trace on its own thread so several traces can be
+ * decoded in parallel while the consumer works on earlier chunks.
+ *
+ * Build with -DTRACE_READER_WITH_LZMA / -DTRACE_READER_WITH_ZSTD (see the
+ * Makefile) to read compressed traces.
+ */
+
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(TRACE_READER_WITH_LZMA)
+#include <lzma.h>
+#endif
+
+#if defined(TRACE_READER_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+// the record layout, shared with the pintool
+#include "trace_format.h"
+
+// Logical thread number <n> of a stream name such as trace_<n>,
+// compressed_<n>.xz or trace_<n>_<OS tid>.zst: the first number in the
+// file name. Returns -1 if there is none.
+inline long long ThreadNumberFromPath(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+    size_t digit = name.find_first_of("0123456789");
+
+    if (digit == std::string::npos)
+    {
+        return -1;
+    }
+
+    return strtoll(name.c_str() + digit, NULL, 10);
+}
+
+class TraceInput
+{
+  public:
+
+    virtual ~TraceInput() {}
+
+    // Next chunk of at most max records. The records stay valid until the
+    // next call. Returns 0 at the end of the trace or on error.
+    virtual size_t next(const trace_instr_format_t **records, size_t max) = 0;
+
+    const std::string& error() const { return error_; }
+
+    // open a trace, the kind is taken from the suffix; NULL and error set on failure
+    static TraceInput* open(const std::string &path, std::string &error);
+
+  protected:
+
+    std::string error_;
+};
+
+// plain trace, mapped as a whole
+class MappedInput : public TraceInput
+{
+  public:
+
+    MappedInput() : base_(NULL), count_(0), position_(0) {}
+
+    ~MappedInput()
+    {
+        if (base_ != NULL)
+        {
+            munmap(base_, count_ * sizeof(trace_instr_format_t));
+        }
+    }
+
+    bool open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            error_ = path + ": " + strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+
+        if (fstat(fd, &st) != 0)
+        {
+            error_ = path + ": " + strerror(errno);
+            close(fd);
+            return false;
+        }
+
+        // a trailing partial record is a cut-off trace, ignore it
+        count_ = st.st_size / sizeof(trace_instr_format_t);
+
+        if (count_ > 0)
+        {
+            void *map = mmap(NULL, count_ * sizeof(trace_instr_format_t), PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (map == MAP_FAILED)
+            {
+                error_ = path + ": " + strerror(errno);
+                close(fd);
+                return false;
+            }
+
+            base_ = static_cast<trace_instr_format_t*>(map);
+            madvise(base_, count_ * sizeof(trace_instr_format_t), MADV_SEQUENTIAL);
+        }
+
+        close(fd);
+        return true;
+    }
+
+    size_t next(const trace_instr_format_t **records, size_t max)
+    {
+        size_t n = count_ - position_;
+
+        if (n > max)
+        {
+            n = max;
+        }
+
+        *records = base_ + position_;
+        position_ += n;
+
+        return n;
+    }
+
+    // the whole trace, for readers that split it themselves
+    const trace_instr_format_t* data() const { return base_; }
+
+    size_t size() const { return count_; }
+
+  private:
+
+    trace_instr_format_t *base_;
+
+    size_t count_;
+
+    size_t position_;
+};
+
+// compressed trace, decoded into a record buffer chunk by chunk
+class DecodedInput : public TraceInput
+{
+  public:
+
+    DecodedInput() : file_(NULL), filled_(0), handedOut_(0), done_(false), inPos_(0), inSize_(0)
+    {
+        in_.resize(1 << 20);
+    }
+
+    virtual ~DecodedInput()
+    {
+        if (file_ != NULL)
+        {
+            fclose(file_);
+        }
+    }
+
+    bool openFile(const std::string &path)
+    {
+        file_ = fopen(path.c_str(), "rb");
+
+        if (file_ == NULL)
+        {
+            error_ = path + ": " + strerror(errno);
+            return false;
+        }
+
+        path_ = path;
+        return true;
+    }
+
+    size_t next(const trace_instr_format_t **records, size_t max)
+    {
+        // the partial record behind the records handed out last time moves
+        // to the front, less than one record
+        if (handedOut_ > 0)
+        {
+            filled_ -= handedOut_;
+            memmove(&out_[0], &out_[handedOut_], filled_);
+            handedOut_ = 0;
+        }
+
+        size_t bytes = max * sizeof(trace_instr_format_t);
+
+        if (out_.size() < bytes)
+        {
+            out_.resize(bytes);
+        }
+
+        while ((filled_ < bytes) && ! done_)
+        {
+            if ((inPos_ == inSize_) && ! feof(file_))
+            {
+                inSize_ = fread(&in_[0], 1, in_.size(), file_);
+                inPos_ = 0;
+
+                if (ferror(file_))
+                {
+                    error_ = path_ + ": read error";
+                    return 0;
+                }
+            }
+
+            size_t produced = 0;
+            int status = decode(&in_[inPos_], inSize_ - inPos_, &out_[filled_], bytes - filled_, produced);
+
+            filled_ += produced;
+
+            if (status < 0)
+            {
+                return 0;
+            }
+
+            if (status > 0)
+            {
+                done_ = true;
+            }
+            else if ((produced == 0) && (inPos_ == inSize_) && feof(file_))
+            {
+                done_ = true;
+
+                // the records decoded so far are still handed out, the
+                // next call returns 0 with the error
+                if ( ! complete())
+                {
+                    error_ = path_ + ": truncated, the compressed data ends early";
+                }
+            }
+        }
+
+        // the records are used in place, they stay valid until the next call
+        size_t n = filled_ / sizeof(trace_instr_format_t);
+
+        handedOut_ = n * sizeof(trace_instr_format_t);
+
+        *records = reinterpret_cast<const trace_instr_format_t*>((n > 0) ? &out_[0] : NULL);
+
+        return n;
+    }
+
+  protected:
+
+    // Decode from in (advancing inPos_) into out. Returns 1 at the end of the
+    // data, -1 on error (error_ set), 0 otherwise.
+    virtual int decode(const uint8_t *in, size_t inSize, uint8_t *out, size_t outSize, size_t &produced) = 0;
+
+    // whether the data decoded so far ends where a stream or frame ends, for
+    // decoders that do not report the end of the data from decode()
+    virtual bool complete() const { return false; }
+
+    FILE *file_;
+
+    std::string path_;
+
+    std::vector<uint8_t> in_;
+
+    std::vector<uint8_t> out_;
+
+    // bytes decoded into out_, and the whole records of them handed out
+    size_t filled_;
+
+    size_t handedOut_;
+
+    bool done_;
+
+    size_t inPos_;
+
+    size_t inSize_;
+};
+
+#if defined(TRACE_READER_WITH_LZMA)
+class XzInput : public DecodedInput
+{
+  public:
+
+    XzInput()
+    {
+        lzma_stream init = LZMA_STREAM_INIT;
+        stream_ = init;
+    }
+
+    ~XzInput()
+    {
+        lzma_end(&stream_);
+    }
+
+    bool open(const std::string &path)
+    {
+        // the tool may write several concatenated streams
+        if (lzma_stream_decoder(&stream_, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+        {
+            error_ = "could not initialize xz decoder";
+            return false;
+        }
+
+        return openFile(path);
+    }
+
+  protected:
+
+    int decode(const uint8_t *in, size_t inSize, uint8_t *out, size_t outSize, size_t &produced)
+    {
+        stream_.next_in = in;
+        stream_.avail_in = inSize;
+        stream_.next_out = out;
+        stream_.avail_out = outSize;
+
+        lzma_ret ret = lzma_code(&stream_, feof(file_) ? LZMA_FINISH : LZMA_RUN);
+
+        inPos_ += inSize - stream_.avail_in;
+        produced = outSize - stream_.avail_out;
+
+        if (ret == LZMA_STREAM_END)
+        {
+            return 1;
+        }
+
+        if ((ret != LZMA_OK) && (ret != LZMA_BUF_ERROR))
+        {
+            error_ = path_ + ": xz data is corrupt or truncated";
+            return -1;
+        }
+
+        return 0;
+    }
+
+  private:
+
+    lzma_stream stream_;
+};
+#endif
+
+#if defined(TRACE_READER_WITH_ZSTD)
+class ZstdInput : public DecodedInput
+{
+  public:
+
+    ZstdInput() : stream_(ZSTD_createDStream()), frameDone_(true) {}
+
+    ~ZstdInput()
+    {
+        ZSTD_freeDStream(stream_);
+    }
+
+    bool open(const std::string &path)
+    {
+        return openFile(path);
+    }
+
+  protected:
+
+    int decode(const uint8_t *in, size_t inSize, uint8_t *out, size_t outSize, size_t &produced)
+    {
+        ZSTD_inBuffer input = { in, inSize, 0 };
+        ZSTD_outBuffer output = { out, outSize, 0 };
+
+        size_t ret = ZSTD_decompressStream(stream_, &output, &input);
+
+        inPos_ += input.pos;
+        produced = output.pos;
+
+        if (ZSTD_isError(ret))
+        {
+            error_ = path_ + ": " + ZSTD_getErrorName(ret);
+            return -1;
+        }
+
+        // 0 once a frame is decoded and flushed, the tool may write several.
+        // A call that moved nothing says nothing about the last frame.
+        if ((input.pos > 0) || (output.pos > 0))
+        {
+            frameDone_ = (ret == 0);
+        }
+
+        return 0;
+    }
+
+    bool complete() const { return frameDone_; }
+
+  private:
+
+    ZSTD_DStream *stream_;
+
+    bool frameDone_;
+};
+#endif
+
+inline bool HasSuffix(const std::string &text, const std::string &suffix)
+{
+    return (text.size() >= suffix.size()) && (text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+inline TraceInput* TraceInput::open(const std::string &path, std::string &error)
+{
+    if (HasSuffix(path, ".xz"))
+    {
+#if defined(TRACE_READER_WITH_LZMA)
+        XzInput *input = new XzInput;
+        if (input->open(path))
+        {
+            return input;
+        }
+        error = input->error();
+        delete input;
+#else
+        error = path + ": built without xz support (WITH_LZMA=1)";
+#endif
+        return NULL;
+    }
+
+    if (HasSuffix(path, ".zst"))
+    {
+#if defined(TRACE_READER_WITH_ZSTD)
+        ZstdInput *input = new ZstdInput;
+        if (input->open(path))
+        {
+            return input;
+        }
+        error = input->error();
+        delete input;
+#else
+        error = path + ": built without zstd support (WITH_ZSTD=1)";
+#endif
+        return NULL;
+    }
+
+    MappedInput *input = new MappedInput;
+    if (input->open(path))
+    {
+        return input;
+    }
+    error = input->error();
+    delete input;
+    return NULL;
+}
+
+// Decodes a trace on a background thread into a bounded queue of chunks.
+class PrefetchInput : public TraceInput
+{
+  public:
+
+    PrefetchInput(TraceInput *input, size_t chunkRecords, size_t maxChunks)
+      : input_(input), chunkRecords_(chunkRecords), maxChunks_(maxChunks), finished_(false), stop_(false)
+    {
+        worker_ = std::thread(&PrefetchInput::run, this);
+    }
+
+    ~PrefetchInput()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stop_ = true;
+        }
+        changed_.notify_all();
+        worker_.join();
+        delete input_;
+    }
+
+    size_t next(const trace_instr_format_t **records, size_t max)
+    {
+        // what is left of the current chunk first
+        if (position_ < current_.size())
+        {
+            return take(records, max);
+        }
+
+        std::unique_lock<std::mutex> guard(lock_);
+
+        changed_.wait(guard, [this] { return ! chunks_.empty() || finished_; });
+
+        if (chunks_.empty())
+        {
+            error_ = input_->error();
+            return 0;
+        }
+
+        current_.swap(chunks_.front());
+        chunks_.pop_front();
+        position_ = 0;
+
+        guard.unlock();
+        changed_.notify_all();
+
+        return take(records, max);
+    }
+
+  private:
+
+    size_t take(const trace_instr_format_t **records, size_t max)
+    {
+        size_t n = current_.size() - position_;
+
+        if (n > max)
+        {
+            n = max;
+        }
+
+        *records = &current_[position_];
+        position_ += n;
+
+        return n;
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            const trace_instr_format_t *records;
+            size_t n = input_->next(&records, chunkRecords_);
+
+            std::unique_lock<std::mutex> guard(lock_);
+
+            if (n == 0)
+            {
+                finished_ = true;
+                break;
+            }
+
+            changed_.wait(guard, [this] { return (chunks_.size() < maxChunks_) || stop_; });
+
+            if (stop_)
+            {
+                break;
+            }
+
+            chunks_.push_back(std::vector<trace_instr_format_t>(records, records + n));
+        }
+
+        changed_.notify_all();
+    }
+
+    TraceInput *input_;
+
+    size_t chunkRecords_;
+
+    size_t maxChunks_;
+
+    std::thread worker_;
+
+    std::mutex lock_;
+
+    std::condition_variable changed_;
+
+    std::deque<std::vector<trace_instr_format_t> > chunks_;
+
+    bool finished_;
+
+    bool stop_;
+
+    std::vector<trace_instr_format_t> current_;
+
+    size_t position_ = 0;
+};
+
+#endif // TRACE_READER_H
@@ -0,0 +1,641 @@
+/*
+ * Characterize the per-thread traces of one run.
+ *
+ * usage: trace_stats [-j <jobs>] [-c <chunk records>] [-R] <trace files...>
+ *
+ * Reports per thread and in total the instruction mix, the branch taken
+ * rate, the memory footprint in cache lines and pages, the LRU stack
+ * (reuse) distance histogram of the cache line accesses (-R skips it), and
+ * the cache lines that more than one thread touched.
+ *
+ * Plain traces are memory-mapped and their instruction mix is counted in
+ * chunks of <chunk records> on <jobs> threads (default: all cores). The
+ * footprint and reuse distances need the accesses in order and are done
+ * per trace, also in parallel. Compressed traces are decoded and analyzed
+ * by one job each.
+ *
+ * Built with AVX2 (the Makefile uses -march=native), the 64-byte records are
+ * scanned as two 256-bit vectors each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "trace_reader.h"
+
+#define LINE_SHIFT 6
+#define PAGE_SHIFT 12
+
+// bucket 0 is distance 0, bucket b > 0 is [2^(b-1), 2^b)
+#define REUSE_BUCKETS 64
+
+#define LINE_READ 1
+#define LINE_WRITTEN 2
+
+struct MixCounts
+{
+    uint64_t instructions;
+    uint64_t branches;
+    uint64_t taken;
+
+    // instructions with at least one memory source / destination
+    uint64_t loads;
+    uint64_t stores;
+
+    // memory operands
+    uint64_t reads;
+    uint64_t writes;
+
+    void add(const MixCounts &other)
+    {
+        instructions += other.instructions;
+        branches += other.branches;
+        taken += other.taken;
+        loads += other.loads;
+        stores += other.stores;
+        reads += other.reads;
+        writes += other.writes;
+    }
+};
+
+static void ScanRecords(const trace_instr_format_t *records, size_t count, MixCounts &mix)
+{
+    uint64_t branches = 0, taken = 0, loads = 0, stores = 0, reads = 0, writes = 0, markers = 0;
+
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (IsMarkerRecord(records + i))
+        {
+            markers++;
+            continue;
+        }
+
+        const char *record = reinterpret_cast<const char*>(records + i);
+
+        // ip, branch flags and registers, destination_memory[2] | source_memory[4]
+        __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(record));
+        __m256i sources = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(record + 32));
+
+        unsigned headZero = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(head, zero)));
+        unsigned sourceZero = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(sources, zero)));
+
+        unsigned destinationMask = (~headZero >> 2) & 0x3;
+        unsigned sourceMask = ~sourceZero & 0xF;
+
+        reads += __builtin_popcount(sourceMask);
+        writes += __builtin_popcount(destinationMask);
+        loads += (sourceMask != 0);
+        stores += (destinationMask != 0);
+
+        branches += records[i].is_branch;
+        taken += records[i].is_branch & records[i].branch_taken;
+    }
+#else
+    for (size_t i = 0; i < count; i++)
+    {
+        const trace_instr_format_t &r = records[i];
+
+        if (IsMarkerRecord(&r))
+        {
+            markers++;
+            continue;
+        }
+
+        unsigned sourceCount = (r.source_memory[0] != 0) + (r.source_memory[1] != 0) + (r.source_memory[2] != 0) + (r.source_memory[3] != 0);
+        unsigned destinationCount = (r.destination_memory[0] != 0) + (r.destination_memory[1] != 0);
+
+        reads += sourceCount;
+        writes += destinationCount;
+        loads += (sourceCount != 0);
+        stores += (destinationCount != 0);
+
+        branches += r.is_branch;
+        taken += r.is_branch & r.branch_taken;
+    }
+#endif
+
+    mix.instructions += count - markers;
+    mix.branches += branches;
+    mix.taken += taken;
+    mix.loads += loads;
+    mix.stores += stores;
+    mix.reads += reads;
+    mix.writes += writes;
+}
+
+static unsigned ReuseBucket(uint64_t distance)
+{
+    return (distance == 0) ? 0 : 64 - __builtin_clzll(distance);
+}
+
+// Cache lines of one thread in access order: footprint, and with reuse
+// distances on, the LRU stack distance of every access. The stack distance
+// is the number of lines accessed since the last access to the same line;
+// a Fenwick tree over access positions, with a mark at each line's last
+// position, counts them in O(log n).
+class LineTracker
+{
+  public:
+
+    struct Line
+    {
+        uint64_t last;
+        uint8_t flags;
+    };
+
+    LineTracker(bool reuse) : reuse_(reuse), next_(0), cold_(0)
+    {
+        histogram_.assign(REUSE_BUCKETS, 0);
+
+        if (reuse_)
+        {
+            tree_.assign((1 << 20) + 1, 0);
+        }
+    }
+
+    void access(uint64_t address, uint8_t flag)
+    {
+        pages_.insert(address >> PAGE_SHIFT);
+
+        if (reuse_ && (next_ + 1 >= tree_.size()))
+        {
+            compact();
+        }
+
+        std::pair<std::unordered_map<uint64_t, Line>::iterator, bool> entry = lines_.insert(std::make_pair(address >> LINE_SHIFT, Line()));
+        Line &line = entry.first->second;
+
+        line.flags |= flag;
+
+        if ( ! reuse_)
+        {
+            return;
+        }
+
+        if (entry.second)
+        {
+            cold_++;
+        }
+        else
+        {
+            // marks after the line's last position, one per line
+            uint64_t distance = lines_.size() - prefix(line.last);
+            histogram_[ReuseBucket(distance)]++;
+            update(line.last, -1);
+        }
+
+        line.last = next_++;
+        update(line.last, 1);
+    }
+
+    const std::unordered_map<uint64_t, Line>& lines() const { return lines_; }
+
+    const std::unordered_set<uint64_t>& pageSet() const { return pages_; }
+
+    size_t pages() const { return pages_.size(); }
+
+    const std::vector<uint64_t>& histogram() const { return histogram_; }
+
+    uint64_t cold() const { return cold_; }
+
+    void releasePages() { std::unordered_set<uint64_t>().swap(pages_); }
+
+    void releaseReuse() { std::vector<int32_t>().swap(tree_); }
+
+  private:
+
+    // marks at positions 0..position
+    uint64_t prefix(uint64_t position) const
+    {
+        int64_t sum = 0;
+        for (uint64_t i = position + 1; i > 0; i -= i & (~i + 1))
+        {
+            sum += tree_[i];
+        }
+        return sum;
+    }
+
+    void update(uint64_t position, int32_t delta)
+    {
+        for (uint64_t i = position + 1; i < tree_.size(); i += i & (~i + 1))
+        {
+            tree_[i] += delta;
+        }
+    }
+
+    // renumber the last positions 0..lines-1, keeping their order
+    void compact()
+    {
+        std::vector<std::pair<uint64_t, Line*> > order;
+        order.reserve(lines_.size());
+
+        for (std::unordered_map<uint64_t, Line>::iterator it = lines_.begin(); it != lines_.end(); ++it)
+        {
+            order.push_back(std::make_pair(it->second.last, &it->second));
+        }
+
+        std::sort(order.begin(), order.end());
+
+        size_t size = std::max<size_t>(2 * order.size(), 1 << 20) + 1;
+        tree_.assign(size, 0);
+
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i].second->last = i;
+            tree_[i + 1] = 1;
+        }
+
+        for (size_t i = 1; i < size; i++)
+        {
+            size_t parent = i + (i & (~i + 1));
+            if (parent < size)
+            {
+                tree_[parent] += tree_[i];
+            }
+        }
+
+        next_ = order.size();
+    }
+
+    bool reuse_;
+
+    std::unordered_map<uint64_t, Line> lines_;
+
+    std::unordered_set<uint64_t> pages_;
+
+    std::vector<int32_t> tree_;
+
+    uint64_t next_;
+
+    uint64_t cold_;
+
+    std::vector<uint64_t> histogram_;
+};
+
+static void TrackRecords(const trace_instr_format_t *records, size_t count, LineTracker &tracker)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const trace_instr_format_t &r = records[i];
+
+        if (IsMarkerRecord(&r))
+        {
+            continue;
+        }
+
+        for (int j = 0; j < NUM_INSTR_SOURCES; j++)
+        {
+            if (r.source_memory[j] != 0)
+            {
+                tracker.access(r.source_memory[j], LINE_READ);
+            }
+        }
+
+        for (int j = 0; j < NUM_INSTR_DESTINATIONS; j++)
+        {
+            if (r.destination_memory[j] != 0)
+            {
+                tracker.access(r.destination_memory[j], LINE_WRITTEN);
+            }
+        }
+    }
+}
+
+struct TraceStats
+{
+    std::string path;
+
+    long long thread;
+
+    TraceInput *input;
+
+    // set for plain traces, whose mix is counted in chunks
+    const MappedInput *mapped;
+
+    std::vector<MixCounts> chunkMix;
+
+    MixCounts mix;
+
+    LineTracker *tracker;
+
+    std::string error;
+};
+
+struct Job
+{
+    TraceStats *trace;
+
+    // chunk index for a mix job, -1 for the per-trace job
+    long long chunk;
+};
+
+static size_t chunkRecords = 1 << 20;
+
+static bool reuseDistances = true;
+
+static void RunJob(const Job &job)
+{
+    TraceStats &trace = *job.trace;
+
+    if (job.chunk >= 0)
+    {
+        size_t begin = job.chunk * chunkRecords;
+        size_t count = std::min(chunkRecords, trace.mapped->size() - begin);
+
+        ScanRecords(trace.mapped->data() + begin, count, trace.chunkMix[job.chunk]);
+        return;
+    }
+
+    trace.tracker = new LineTracker(reuseDistances);
+
+    if (trace.mapped != NULL)
+    {
+        TrackRecords(trace.mapped->data(), trace.mapped->size(), *trace.tracker);
+        return;
+    }
+
+    const trace_instr_format_t *records;
+    size_t count;
+
+    while ((count = trace.input->next(&records, chunkRecords)) > 0)
+    {
+        ScanRecords(records, count, trace.mix);
+        TrackRecords(records, count, *trace.tracker);
+    }
+
+    trace.error = trace.input->error();
+}
+
+static void Worker(std::vector<Job> *jobs, std::atomic<size_t> *next)
+{
+    size_t index;
+
+    while ((index = next->fetch_add(1)) < jobs->size())
+    {
+        RunJob((*jobs)[index]);
+    }
+}
+
+static double Percent(uint64_t part, uint64_t whole)
+{
+    return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+static void PrintMix(const char *name, const MixCounts &mix, size_t lines, size_t pages)
+{
+    printf("%-8s %14llu %6.2f%% %6.2f%% %6.2f%% %6.2f%% %12zu %10zu %12.1f\n",
+        name, (unsigned long long)mix.instructions,
+        Percent(mix.branches, mix.instructions), Percent(mix.taken, mix.branches),
+        Percent(mix.loads, mix.instructions), Percent(mix.stores, mix.instructions),
+        lines, pages, (double)(lines << LINE_SHIFT) / (1 << 20));
+}
+
+static void Usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j <jobs>] [-c <chunk records>] [-R] <trace files...>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned jobCount = std::thread::hardware_concurrency();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:c:R")) != -1)
+    {
+        switch (opt)
+        {
+          case 'j': jobCount = strtoul(optarg, NULL, 10); break;
+          case 'c': chunkRecords = strtoull(optarg, NULL, 10); break;
+          case 'R': reuseDistances = false; break;
+          default: Usage(argv[0]); return 1;
+        }
+    }
+
+    if ((optind == argc) || (chunkRecords == 0))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    if (jobCount == 0)
+    {
+        jobCount = 1;
+    }
+
+    std::vector<TraceStats*> traces;
+    std::vector<Job> jobs;
+
+    for (int i = optind; i < argc; i++)
+    {
+        TraceStats *trace = new TraceStats();
+        trace->path = argv[i];
+        trace->thread = ThreadNumberFromPath(argv[i]);
+
+        std::string error;
+        trace->input = TraceInput::open(argv[i], error);
+
+        if (trace->input == NULL)
+        {
+            fprintf(stderr, "Error: %s\n", error.c_str());
+            return 1;
+        }
+
+        trace->mapped = dynamic_cast<MappedInput*>(trace->input);
+
+        // the long, ordered per-trace jobs go first
+        Job job = { trace, -1 };
+        jobs.push_back(job);
+
+        traces.push_back(trace);
+    }
+
+    for (size_t i = 0; i < traces.size(); i++)
+    {
+        if (traces[i]->mapped == NULL)
+        {
+            continue;
+        }
+
+        size_t chunks = (traces[i]->mapped->size() + chunkRecords - 1) / chunkRecords;
+        traces[i]->chunkMix.assign(chunks, MixCounts());
+
+        for (size_t c = 0; c < chunks; c++)
+        {
+            Job job = { traces[i], (long long)c };
+            jobs.push_back(job);
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+
+    for (unsigned i = 1; i < std::min<size_t>(jobCount, jobs.size()); i++)
+    {
+        workers.push_back(std::thread(Worker, &jobs, &next));
+    }
+
+    Worker(&jobs, &next);
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    for (size_t i = 0; i < traces.size(); i++)
+    {
+        if ( ! traces[i]->error.empty())
+        {
+            fprintf(stderr, "Error: %s\n", traces[i]->error.c_str());
+            return 1;
+        }
+
+        for (size_t c = 0; c < traces[i]->chunkMix.size(); c++)
+        {
+            traces[i]->mix.add(traces[i]->chunkMix[c]);
+        }
+    }
+
+    // lines of every thread: the first thread, how many threads, written by any
+    struct SharedLine
+    {
+        size_t first;
+        uint32_t threads;
+        uint8_t flags;
+    };
+
+    std::unordered_map<uint64_t, SharedLine> allLines;
+    std::vector<uint64_t> totalHistogram(REUSE_BUCKETS, 0);
+    uint64_t totalCold = 0;
+    std::unordered_set<uint64_t> allPages;
+    MixCounts total = MixCounts();
+
+    printf("Thread     Instructions Branch  Taken   Loads  Stores   Footprint:   Lines      Pages          MB\n");
+
+    for (size_t i = 0; i < traces.size(); i++)
+    {
+        TraceStats &trace = *traces[i];
+        const std::unordered_map<uint64_t, LineTracker::Line> &lines = trace.tracker->lines();
+
+        std::string name = (trace.thread < 0) ? trace.path : std::to_string(trace.thread);
+        PrintMix(name.c_str(), trace.mix, lines.size(), trace.tracker->pages());
+
+        total.add(trace.mix);
+        allPages.insert(trace.tracker->pageSet().begin(), trace.tracker->pageSet().end());
+        trace.tracker->releasePages();
+        trace.tracker->releaseReuse();
+
+        for (std::unordered_map<uint64_t, LineTracker::Line>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+        {
+            std::pair<std::unordered_map<uint64_t, SharedLine>::iterator, bool> entry = allLines.insert(std::make_pair(it->first, SharedLine()));
+            SharedLine &line = entry.first->second;
+
+            if (entry.second)
+            {
+                line.first = i;
+            }
+
+            line.threads++;
+            line.flags |= it->second.flags;
+        }
+
+        for (unsigned b = 0; b < REUSE_BUCKETS; b++)
+        {
+            totalHistogram[b] += trace.tracker->histogram()[b];
+        }
+        totalCold += trace.tracker->cold();
+    }
+
+    // lines and pages touched by any thread, shared ones count once
+    PrintMix("total", total, allLines.size(), allPages.size());
+
+    printf("\nMemory operands: %llu reads, %llu writes\n", (unsigned long long)total.reads, (unsigned long long)total.writes);
+
+    uint64_t shared = 0, sharedWritten = 0;
+    std::vector<uint64_t> sharers(33, 0);
+
+    for (std::unordered_map<uint64_t, SharedLine>::const_iterator it = allLines.begin(); it != allLines.end(); ++it)
+    {
+        if (it->second.threads > 1)
+        {
+            shared++;
+            sharedWritten += (it->second.flags & LINE_WRITTEN) != 0;
+            sharers[ReuseBucket(it->second.threads - 1)]++;
+        }
+    }
+
+    printf("\nShared cache lines: %llu of %zu (%.2f%%), %llu of them written\n",
+        (unsigned long long)shared, allLines.size(), Percent(shared, allLines.size()), (unsigned long long)sharedWritten);
+
+    for (unsigned b = 1; b < sharers.size(); b++)
+    {
+        if (sharers[b] != 0)
+        {
+            printf("  %6llu-%-6llu threads: %llu lines\n", (1ULL << (b - 1)) + 1, (1ULL << b), (unsigned long long)sharers[b]);
+        }
+    }
+
+    if (reuseDistances)
+    {
+        uint64_t accesses = totalCold;
+        for (unsigned b = 0; b < REUSE_BUCKETS; b++)
+        {
+            accesses += totalHistogram[b];
+        }
+
+        // cumulative: hit rate of a fully associative LRU cache of that many lines
+        printf("\nReuse distance (lines, per thread)   Accesses       %%  Cumulative\n");
+
+        uint64_t cumulative = 0;
+
+        for (unsigned b = 0; b < REUSE_BUCKETS; b++)
+        {
+            if (totalHistogram[b] == 0)
+            {
+                continue;
+            }
+
+            cumulative += totalHistogram[b];
+
+            char range[64];
+            if (b == 0)
+            {
+                snprintf(range, sizeof(range), "0");
+            }
+            else
+            {
+                snprintf(range, sizeof(range), "%llu-%llu", 1ULL << (b - 1), (1ULL << b) - 1);
+            }
+
+            printf("  %-32s %10llu %6.2f%% %10.2f%%\n", range, (unsigned long long)totalHistogram[b],
+                Percent(totalHistogram[b], accesses), Percent(cumulative, accesses));
+        }
+
+        printf("  %-32s %10llu %6.2f%%\n", "cold", (unsigned long long)totalCold, Percent(totalCold, accesses));
+    }
+
+    for (size_t i = 0; i < traces.size(); i++)
+    {
+        delete traces[i]->tracker;
+        delete traces[i]->input;
+        delete traces[i];
+    }
+
+    return 0;
+}
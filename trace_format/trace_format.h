@@ -0,0 +1,304 @@
+/*
+ * The ChampSim trace record written by the pintool and read by the offline
+ * tools, with its encoders and decoder. No Pin dependency.
+ *
+ * A record is encoded either operand by operand (BeginRecord, then the
+ * Insert* helpers), or in one go from an instr_template_t that holds the
+ * static part of an instruction, plus the branch outcome and effective
+ * addresses known only at run time (EncodeFromTemplate). Both give the same
+ * bytes. DecodeRecord turns a record back into operand lists. Marker
+ * records (clock values for -clock) can be mixed into a thread's trace.
+ *
+ * trace_format_bench checks that the encoders agree and round-trip through
+ * the decoder, and measures their throughput (see the Makefile).
+ */
+
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define NUM_INSTR_DESTINATIONS 2
+#define NUM_INSTR_SOURCES 4
+
+typedef struct trace_instr_format {
+    unsigned long long int ip;  // instruction pointer (program counter) value
+
+    unsigned char is_branch;    // is this branch
+    unsigned char branch_taken; // if so, is this taken
+
+    unsigned char destination_registers[NUM_INSTR_DESTINATIONS]; // output registers
+    unsigned char source_registers[NUM_INSTR_SOURCES];           // input registers
+
+    unsigned long long int destination_memory[NUM_INSTR_DESTINATIONS]; // output memory
+    unsigned long long int source_memory[NUM_INSTR_SOURCES];           // input memory
+
+} trace_instr_format_t;
+
+// Empty record for the instruction at ip.
+static inline void BeginRecord(trace_instr_format_t *trace, unsigned long long int ip)
+{
+    trace->ip = ip;
+
+    trace->is_branch = 0;
+    trace->branch_taken = 0;
+
+    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+    {
+        trace->destination_registers[i] = 0;
+        trace->destination_memory[i] = 0;
+    }
+
+    for(int i=0; i<NUM_INSTR_SOURCES; i++)
+    {
+        trace->source_registers[i] = 0;
+        trace->source_memory[i] = 0;
+    }
+}
+
+// Add a register or memory operand to a record unless it is already there.
+// Zero marks an empty slot, operands beyond the last slot are dropped.
+static inline void InsertSourceRegister(trace_instr_format_t *trace, unsigned char r)
+{
+    for(int i=0; i<NUM_INSTR_SOURCES; i++)
+    {
+        if(trace->source_registers[i] == r)
+        {
+            return;
+        }
+    }
+    for(int i=0; i<NUM_INSTR_SOURCES; i++)
+    {
+        if(trace->source_registers[i] == 0)
+        {
+            trace->source_registers[i] = r;
+            return;
+        }
+    }
+}
+
+static inline void InsertDestinationRegister(trace_instr_format_t *trace, unsigned char r)
+{
+    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+    {
+        if(trace->destination_registers[i] == r)
+        {
+            return;
+        }
+    }
+    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+    {
+        if(trace->destination_registers[i] == 0)
+        {
+            trace->destination_registers[i] = r;
+            return;
+        }
+    }
+}
+
+static inline void InsertSourceMemory(trace_instr_format_t *trace, unsigned long long int addr)
+{
+    for(int i=0; i<NUM_INSTR_SOURCES; i++)
+    {
+        if(trace->source_memory[i] == addr)
+        {
+            return;
+        }
+    }
+    for(int i=0; i<NUM_INSTR_SOURCES; i++)
+    {
+        if(trace->source_memory[i] == 0)
+        {
+            trace->source_memory[i] = addr;
+            return;
+        }
+    }
+}
+
+static inline void InsertDestinationMemory(trace_instr_format_t *trace, unsigned long long int addr)
+{
+    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+    {
+        if(trace->destination_memory[i] == addr)
+        {
+            return;
+        }
+    }
+    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+    {
+        if(trace->destination_memory[i] == 0)
+        {
+            trace->destination_memory[i] = addr;
+            return;
+        }
+    }
+}
+
+// Static part of an instruction's record (ip, is_branch and the deduplicated
+// registers), built once when the instruction is instrumented. Only the
+// memory addresses and the branch outcome are filled in at run time.
+#define MEMOP_READ  1
+#define MEMOP_WRITE 2
+
+// instructions with more memory operands are encoded operand by operand
+#define MAX_TEMPLATE_MEMOPS 2
+
+struct instr_template_t
+{
+    trace_instr_format_t record;
+    uint8_t memOpFlags[MAX_TEMPLATE_MEMOPS];
+};
+
+// Template for the instruction at ip: an empty record and no memory operands.
+static inline void BeginTemplate(instr_template_t *tmpl, unsigned long long int ip, int isBranch)
+{
+    memset(tmpl, 0, sizeof(instr_template_t));
+
+    tmpl->record.ip = ip;
+    tmpl->record.is_branch = isBranch ? 1 : 0;
+}
+
+// Whole record from a template, the branch outcome and the effective
+// addresses of the template's memory operands (absent ones are ignored).
+static inline void EncodeFromTemplate(trace_instr_format_t *trace, const instr_template_t *tmpl,
+        uint32_t taken, const uint64_t ea[MAX_TEMPLATE_MEMOPS])
+{
+    *trace = tmpl->record;
+
+    trace->branch_taken = (taken != 0);
+
+    for (int i = 0; i < MAX_TEMPLATE_MEMOPS; i++)
+    {
+        if (tmpl->memOpFlags[i] & MEMOP_READ)
+        {
+            InsertSourceMemory(trace, ea[i]);
+        }
+        if (tmpl->memOpFlags[i] & MEMOP_WRITE)
+        {
+            InsertDestinationMemory(trace, ea[i]);
+        }
+    }
+}
+
+// A record as operand lists, in slot order.
+struct decoded_instr_t
+{
+    uint64_t ip;
+    bool isBranch;
+    bool taken;
+
+    int numSourceRegisters;
+    unsigned char sourceRegisters[NUM_INSTR_SOURCES];
+
+    int numDestinationRegisters;
+    unsigned char destinationRegisters[NUM_INSTR_DESTINATIONS];
+
+    int numSourceMemory;
+    uint64_t sourceMemory[NUM_INSTR_SOURCES];
+
+    int numDestinationMemory;
+    uint64_t destinationMemory[NUM_INSTR_DESTINATIONS];
+};
+
+static inline void DecodeRecord(const trace_instr_format_t *trace, decoded_instr_t *out)
+{
+    out->ip = trace->ip;
+    out->isBranch = (trace->is_branch != 0);
+    out->taken = (trace->branch_taken != 0);
+
+    out->numSourceRegisters = 0;
+    out->numSourceMemory = 0;
+
+    for (int i = 0; i < NUM_INSTR_SOURCES; i++)
+    {
+        if (trace->source_registers[i] != 0)
+        {
+            out->sourceRegisters[out->numSourceRegisters++] = trace->source_registers[i];
+        }
+        if (trace->source_memory[i] != 0)
+        {
+            out->sourceMemory[out->numSourceMemory++] = trace->source_memory[i];
+        }
+    }
+
+    out->numDestinationRegisters = 0;
+    out->numDestinationMemory = 0;
+
+    for (int i = 0; i < NUM_INSTR_DESTINATIONS; i++)
+    {
+        if (trace->destination_registers[i] != 0)
+        {
+            out->destinationRegisters[out->numDestinationRegisters++] = trace->destination_registers[i];
+        }
+        if (trace->destination_memory[i] != 0)
+        {
+            out->destinationMemory[out->numDestinationMemory++] = trace->destination_memory[i];
+        }
+    }
+}
+
+// Marker records are not instructions, their ip is TRACE_MARKER_IP, which no
+// instruction has. destination_registers[0] holds the marker type. Anything
+// that feeds a trace to a simulator has to drop them (trace_merge does).
+#define TRACE_MARKER_IP 0
+
+#define MARKER_CLOCK 1
+
+// A clock marker (-clock) follows instruction insNum of its thread and holds
+// the value of a clock shared by all threads at that point:
+//   source_registers[0]        clock source, CLOCK_LOGICAL or CLOCK_TSC
+//   destination_registers[1]   what triggered it, CLOCK_AT_*
+//   source_memory[0]           clock value
+//   source_memory[1]           insNum
+#define CLOCK_LOGICAL 1 // a global counter, incremented by every marker
+#define CLOCK_TSC     2 // the time stamp counter
+
+#define CLOCK_AT_START      1 // first marker of the thread's trace
+#define CLOCK_AT_INTERVAL   2 // every -clock_interval instructions
+#define CLOCK_AT_SYNC       3 // pthread call or return, futex syscall
+#define CLOCK_AT_WINDOW_END 4 // the ROI or -trace_length window ended here
+#define CLOCK_AT_END        5 // the thread exited
+
+static inline bool IsMarkerRecord(const trace_instr_format_t *trace)
+{
+    return trace->ip == TRACE_MARKER_IP;
+}
+
+static inline void EncodeClockMarker(trace_instr_format_t *trace, unsigned char source, unsigned char reason,
+        uint64_t clock, uint64_t insNum)
+{
+    BeginRecord(trace, TRACE_MARKER_IP);
+
+    trace->destination_registers[0] = MARKER_CLOCK;
+    trace->destination_registers[1] = reason;
+    trace->source_registers[0] = source;
+    trace->source_memory[0] = clock;
+    trace->source_memory[1] = insNum;
+}
+
+struct clock_marker_t
+{
+    unsigned char source;
+    unsigned char reason;
+    uint64_t clock;
+    uint64_t insNum;
+};
+
+// Returns false if the record is not a clock marker.
+static inline bool DecodeClockMarker(const trace_instr_format_t *trace, clock_marker_t *out)
+{
+    if ( ! IsMarkerRecord(trace) || (trace->destination_registers[0] != MARKER_CLOCK))
+    {
+        return false;
+    }
+
+    out->source = trace->source_registers[0];
+    out->reason = trace->destination_registers[1];
+    out->clock = trace->source_memory[0];
+    out->insNum = trace->source_memory[1];
+
+    return true;
+}
+
+#endif // TRACE_FORMAT_H
@@ -0,0 +1,341 @@
+/*
+ * Round-trip checks and throughput of the encoders and the decoder of
+ * trace_format.h.
+ *
+ * usage: trace_format_bench [-n records] [-r repeats] [-s seed]
+ *
+ * Random instructions (registers and addresses with repeats, so the
+ * deduplication is exercised, and more operands than there are slots) are
+ * encoded operand by operand the way the pintool's per-operand analysis
+ * calls do, and from a template the way RecordInstruction does. The two
+ * records have to be identical, and decoding them has to give the expected
+ * operand lists: duplicates removed, first come first served. Clock markers
+ * are checked the same way. Then each of
+ * the three paths is timed over all records, -r times, and the best rate is
+ * printed in records per second. The exit code is 1 if a check failed.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trace_format.h"
+
+#define MAX_REGS 8
+
+// what the instrumentation knows about an instruction, plus its run-time values
+struct instr_spec_t
+{
+    uint64_t ip;
+    bool isBranch;
+    bool taken;
+
+    int numReads;
+    unsigned char reads[MAX_REGS];
+
+    int numWrites;
+    unsigned char writes[MAX_REGS];
+
+    int numMemOps;
+    uint8_t memOpFlags[MAX_TEMPLATE_MEMOPS];
+    uint64_t ea[MAX_TEMPLATE_MEMOPS];
+};
+
+static uint64_t randomState;
+
+static uint64_t Random()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+static void RandomSpec(instr_spec_t *spec)
+{
+    spec->ip = 0x400000 + (Random() % (1 << 20));
+    spec->isBranch = (Random() % 5) == 0;
+    spec->taken = spec->isBranch && (Random() & 1);
+
+    // small register numbers so the lists repeat
+    spec->numReads = Random() % (MAX_REGS + 1);
+    for (int i = 0; i < spec->numReads; i++)
+    {
+        spec->reads[i] = 1 + Random() % 6;
+    }
+
+    spec->numWrites = Random() % 4;
+    for (int i = 0; i < spec->numWrites; i++)
+    {
+        spec->writes[i] = 1 + Random() % 6;
+    }
+
+    // both operands on the same address now and then, like push/pop pairs
+    spec->numMemOps = Random() % (MAX_TEMPLATE_MEMOPS + 1);
+    for (int i = 0; i < spec->numMemOps; i++)
+    {
+        spec->memOpFlags[i] = 1 + Random() % 3;
+        spec->ea[i] = ((i > 0) && (Random() % 4 == 0)) ? spec->ea[0] : 0x7f0000000000ULL + (Random() & ~7ULL) % (1 << 30) + 8;
+    }
+    for (int i = spec->numMemOps; i < MAX_TEMPLATE_MEMOPS; i++)
+    {
+        spec->memOpFlags[i] = 0;
+        spec->ea[i] = 0;
+    }
+}
+
+// the pintool's per-operand path: BeginInstruction, BranchOrNot, RegRead,
+// RegWrite, MemoryRead / MemoryWrite
+static inline void EncodeByOperand(const instr_spec_t &spec, trace_instr_format_t *trace)
+{
+    BeginRecord(trace, spec.ip);
+
+    if (spec.isBranch)
+    {
+        trace->is_branch = 1;
+        trace->branch_taken = spec.taken;
+    }
+
+    for (int i = 0; i < spec.numReads; i++)
+    {
+        InsertSourceRegister(trace, spec.reads[i]);
+    }
+    for (int i = 0; i < spec.numWrites; i++)
+    {
+        InsertDestinationRegister(trace, spec.writes[i]);
+    }
+    for (int i = 0; i < spec.numMemOps; i++)
+    {
+        if (spec.memOpFlags[i] & MEMOP_READ)
+        {
+            InsertSourceMemory(trace, spec.ea[i]);
+        }
+        if (spec.memOpFlags[i] & MEMOP_WRITE)
+        {
+            InsertDestinationMemory(trace, spec.ea[i]);
+        }
+    }
+}
+
+// the pintool's InstructionPrecomputed, done once per static instruction
+static void BuildTemplate(const instr_spec_t &spec, instr_template_t *tmpl)
+{
+    BeginTemplate(tmpl, spec.ip, spec.isBranch);
+
+    for (int i = 0; i < spec.numReads; i++)
+    {
+        InsertSourceRegister(&tmpl->record, spec.reads[i]);
+    }
+    for (int i = 0; i < spec.numWrites; i++)
+    {
+        InsertDestinationRegister(&tmpl->record, spec.writes[i]);
+    }
+    for (int i = 0; i < MAX_TEMPLATE_MEMOPS; i++)
+    {
+        tmpl->memOpFlags[i] = spec.memOpFlags[i];
+    }
+}
+
+// append value to list unless it is there or the list is full
+template <class T>
+static void ExpectOperand(T *list, int &count, int capacity, T value)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (list[i] == value)
+        {
+            return;
+        }
+    }
+
+    if (count < capacity)
+    {
+        list[count++] = value;
+    }
+}
+
+template <class T>
+static bool SameList(const T *a, int countA, const T *b, int countB)
+{
+    if (countA != countB)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < countA; i++)
+    {
+        if (a[i] != b[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool CheckDecoded(const instr_spec_t &spec, const decoded_instr_t &decoded)
+{
+    decoded_instr_t expected;
+    expected.numSourceRegisters = 0;
+    expected.numDestinationRegisters = 0;
+    expected.numSourceMemory = 0;
+    expected.numDestinationMemory = 0;
+
+    for (int i = 0; i < spec.numReads; i++)
+    {
+        ExpectOperand(expected.sourceRegisters, expected.numSourceRegisters, NUM_INSTR_SOURCES, spec.reads[i]);
+    }
+    for (int i = 0; i < spec.numWrites; i++)
+    {
+        ExpectOperand(expected.destinationRegisters, expected.numDestinationRegisters, NUM_INSTR_DESTINATIONS, spec.writes[i]);
+    }
+    for (int i = 0; i < spec.numMemOps; i++)
+    {
+        if (spec.memOpFlags[i] & MEMOP_READ)
+        {
+            ExpectOperand(expected.sourceMemory, expected.numSourceMemory, NUM_INSTR_SOURCES, spec.ea[i]);
+        }
+        if (spec.memOpFlags[i] & MEMOP_WRITE)
+        {
+            ExpectOperand(expected.destinationMemory, expected.numDestinationMemory, NUM_INSTR_DESTINATIONS, spec.ea[i]);
+        }
+    }
+
+    return (decoded.ip == spec.ip) && (decoded.isBranch == spec.isBranch) && (decoded.taken == spec.taken)
+        && SameList(decoded.sourceRegisters, decoded.numSourceRegisters, expected.sourceRegisters, expected.numSourceRegisters)
+        && SameList(decoded.destinationRegisters, decoded.numDestinationRegisters, expected.destinationRegisters, expected.numDestinationRegisters)
+        && SameList(decoded.sourceMemory, decoded.numSourceMemory, expected.sourceMemory, expected.numSourceMemory)
+        && SameList(decoded.destinationMemory, decoded.numDestinationMemory, expected.destinationMemory, expected.numDestinationMemory);
+}
+
+// best of repeats runs of work(), in records per second
+template <class Work>
+static double BestRate(size_t records, int repeats, Work work)
+{
+    double best = 0;
+
+    for (int r = 0; r < repeats; r++)
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        work();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        if ((seconds > 0) && (records / seconds > best))
+        {
+            best = records / seconds;
+        }
+    }
+
+    return best;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n records] [-r repeats] [-s seed]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = 1000000;
+    int repeats = 5;
+    randomState = 88172645463325252ULL;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = strtoull(optarg, NULL, 10); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 's': randomState = strtoull(optarg, NULL, 10) | 1; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (count == 0)
+    {
+        usage(argv[0]);
+    }
+
+    std::vector<instr_spec_t> specs(count);
+    std::vector<instr_template_t> templates(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        RandomSpec(&specs[i]);
+        BuildTemplate(specs[i], &templates[i]);
+    }
+
+    std::vector<trace_instr_format_t> byOperand(count);
+    std::vector<trace_instr_format_t> fromTemplate(count);
+    std::vector<decoded_instr_t> decoded(count);
+
+    size_t failures = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        EncodeByOperand(specs[i], &byOperand[i]);
+        EncodeFromTemplate(&fromTemplate[i], &templates[i], specs[i].taken, specs[i].ea);
+        DecodeRecord(&fromTemplate[i], &decoded[i]);
+
+        // a clock marker with the record's number as clock and ip as instruction number
+        trace_instr_format_t marker;
+        clock_marker_t clock;
+        EncodeClockMarker(&marker, CLOCK_LOGICAL, CLOCK_AT_INTERVAL, i, specs[i].ip);
+
+        bool markerOk = ! IsMarkerRecord(&fromTemplate[i]) && DecodeClockMarker(&marker, &clock)
+            && (clock.source == CLOCK_LOGICAL) && (clock.reason == CLOCK_AT_INTERVAL) && (clock.clock == i) && (clock.insNum == specs[i].ip);
+
+        if ((memcmp(&byOperand[i], &fromTemplate[i], sizeof(trace_instr_format_t)) != 0) || ! CheckDecoded(specs[i], decoded[i]) || ! markerOk)
+        {
+            if (failures++ < 10)
+            {
+                fprintf(stderr, "record %zu at ip 0x%llx does not round-trip\n", i, (unsigned long long)specs[i].ip);
+            }
+        }
+    }
+
+    printf("round trip: %zu records, %zu failed\n", count, failures);
+
+    if (repeats > 0)
+    {
+        double byOperandRate = BestRate(count, repeats, [&] {
+            for (size_t i = 0; i < count; i++)
+            {
+                EncodeByOperand(specs[i], &byOperand[i]);
+            }
+        });
+
+        double templateRate = BestRate(count, repeats, [&] {
+            for (size_t i = 0; i < count; i++)
+            {
+                EncodeFromTemplate(&fromTemplate[i], &templates[i], specs[i].taken, specs[i].ea);
+            }
+        });
+
+        double decodeRate = BestRate(count, repeats, [&] {
+            for (size_t i = 0; i < count; i++)
+            {
+                DecodeRecord(&fromTemplate[i], &decoded[i]);
+            }
+        });
+
+        // keep the results alive
+        unsigned long long checksum = 0;
+        for (size_t i = 0; i < count; i += 4096)
+        {
+            checksum += byOperand[i].ip + fromTemplate[i].source_memory[0] + decoded[i].numSourceRegisters;
+        }
+
+        printf("encode by operand: %.1f M records/s\n", byOperandRate / 1e6);
+        printf("encode from template: %.1f M records/s\n", templateRate / 1e6);
+        printf("decode: %.1f M records/s\n", decodeRate / 1e6);
+        printf("checksum %llu\n", checksum);
+    }
+
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# usage: ./check_pages.sh <pintool.so> [-t threads]
+#
+# Runs the onepage microbench workload under -mode pages with short
+# intervals and checks the working sets in pages_intervals.csv: every
+# worker thread touches only its one data page, so every interval of a
+# worker except its first (thread start) and last (thread exit) has to
+# report exactly one 4K and one 2M page. Needs pin on the PATH (see env.sh).
+
+set -e
+
+if [ $# -lt 1 ]
+then
+    echo "usage: $0 <pintool.so> [-t threads]" >&2
+    exit 1
+fi
+
+TOOL=$(realpath "$1")
+shift
+
+BENCH=$(cd "$(dirname "$0")" && pwd)/microbench
+
+THREADS=2
+
+while getopts "t:" opt
+do
+    case ${opt} in
+        t) THREADS=${OPTARG} ;;
+        *) exit 1 ;;
+    esac
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf "${WORK}"' EXIT
+
+pin -t "${TOOL}" -mode pages -pages_interval 100000 -out_dir "${WORK}/out" -o "${WORK}/dependency.jsonl" \
+    -- "${BENCH}" onepage -t "${THREADS}" > /dev/null
+
+# threads 1.. are the workers, thread 0 only starts and joins them
+awk -F, '
+    NR > 1 && $1 > 0 { rows[$1, $2] = $5 " " $6; last[$1] = ($2 > last[$1]) ? $2 : last[$1] }
+    END {
+        failed = 0
+        checked = 0
+        for (key in rows)
+        {
+            split(key, id, SUBSEP)
+            if ((id[2] == 0) || (id[2] == last[id[1]]))
+            {
+                continue
+            }
+            checked++
+            if (rows[key] != "1 1")
+            {
+                printf "thread %d interval %d: pages_4k pages_2m %s, expected 1 1\n", id[1], id[2], rows[key]
+                failed = 1
+            }
+        }
+        if (checked == 0)
+        {
+            print "no worker intervals to check"
+            failed = 1
+        }
+        if ( ! failed)
+        {
+            printf "pages: %d worker intervals with one page each\n", checked
+        }
+        exit failed
+    }' "${WORK}"/out/run_*/pages_intervals.csv
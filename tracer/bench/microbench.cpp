@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// usage: microbench branchy|stream|lock|threads|onepage [-t threads] [-n scale]
+//
+// Small workloads that stress one part of the tracer each, for
+// run_bench.sh. All of them split <scale> units of work over <threads>
+// threads and print a checksum so the work is not optimized away.
+//
+// branchy: data-dependent branches on pseudo-random numbers, few memory ops
+// stream:  every thread sums and rewrites its own 8 MB array, one memory op
+//          per instruction or two
+// lock:    short critical sections on one std::mutex, like contension.cpp
+// threads: many short-lived threads, <threads> at a time, for the thread
+//          start and finish paths
+// onepage: every thread keeps updating its own line of one shared 4K page,
+//          so the data working set of a worker is exactly one page
+//          (check_pages.sh)
+
+using std::thread;
+using std::mutex;
+
+#define STREAM_WORDS (1 << 20)
+
+int numThreads = 4;
+
+long scale = 1;
+
+mutex counterLock;
+
+unsigned long onePage[512] __attribute__((aligned(4096)));
+
+unsigned long counter = 0;
+
+static unsigned long xorshift(unsigned long x)
+{
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+static unsigned long branchy(int index, long units)
+{
+    unsigned long x = 88172645463325252UL + index;
+    unsigned long sum = 0;
+
+    for (long i = 0; i < units * 10000000; i++)
+    {
+        x = xorshift(x);
+
+        if (x & 1)
+        {
+            sum += x >> 3;
+        }
+        else if (x & 2)
+        {
+            sum ^= x;
+        }
+        else
+        {
+            sum -= i;
+        }
+    }
+
+    return sum;
+}
+
+static unsigned long stream(int index, long units)
+{
+    std::vector<unsigned long> data(STREAM_WORDS, index);
+    unsigned long sum = 0;
+
+    for (long pass = 0; pass < units * 32; pass++)
+    {
+        for (long i = 0; i < STREAM_WORDS; i++)
+        {
+            sum += data[i];
+            data[i] = sum;
+        }
+    }
+
+    return sum;
+}
+
+static unsigned long lockHeavy(int index, long units)
+{
+    unsigned long x = index + 1;
+
+    for (long i = 0; i < units * 1000000; i++)
+    {
+        std::lock_guard<mutex> guard(counterLock);
+
+        x = xorshift(x);
+        counter += x & 0xff;
+    }
+
+    return x;
+}
+
+static unsigned long onePageLoop(int index, long units)
+{
+    volatile unsigned long *line = onePage + (index % 64) * 8;
+
+    for (long i = 0; i < units * 10000000; i++)
+    {
+        line[i & 7] += i;
+    }
+
+    return line[0];
+}
+
+static void worker(int workload, int index, long units, unsigned long *result)
+{
+    switch (workload)
+    {
+        case 0: *result = branchy(index, units); break;
+        case 1: *result = stream(index, units); break;
+        case 3: *result = onePageLoop(index, units); break;
+        default: *result = lockHeavy(index, units); break;
+    }
+}
+
+// <scale> units per thread, run by <numThreads> threads
+static unsigned long runParallel(int workload)
+{
+    std::vector<thread> threads;
+    std::vector<unsigned long> results(numThreads, 0);
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        threads.push_back(thread(worker, workload, i, scale, &results[i]));
+    }
+
+    unsigned long sum = 0;
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        threads[i].join();
+        sum += results[i];
+    }
+
+    return sum + counter;
+}
+
+// 1000 * <scale> threads doing a few thousand branches each
+static unsigned long runShortThreads()
+{
+    long total = 1000 * scale;
+    unsigned long sum = 0;
+
+    for (long started = 0; started < total; started += numThreads)
+    {
+        std::vector<thread> threads;
+        std::vector<unsigned long> results(numThreads, 0);
+
+        for (int i = 0; (i < numThreads) && (started + i < total); i++)
+        {
+            threads.push_back(thread([i, started, &results] {
+                unsigned long x = started + i + 1;
+
+                for (int k = 0; k < 5000; k++)
+                {
+                    x = xorshift(x);
+                }
+
+                results[i] = x;
+            }));
+        }
+
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+            sum += results[i];
+        }
+    }
+
+    return sum;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s branchy|stream|lock|threads|onepage [-t threads] [-n scale]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+    }
+
+    const char *workload = argv[1];
+
+    int opt;
+
+    optind = 2;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': numThreads = atoi(optarg); break;
+            case 'n': scale = atol(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if ((numThreads < 1) || (scale < 1))
+    {
+        usage(argv[0]);
+    }
+
+    unsigned long checksum;
+
+    if (strcmp(workload, "branchy") == 0)
+    {
+        checksum = runParallel(0);
+    }
+    else if (strcmp(workload, "stream") == 0)
+    {
+        checksum = runParallel(1);
+    }
+    else if (strcmp(workload, "lock") == 0)
+    {
+        checksum = runParallel(2);
+    }
+    else if (strcmp(workload, "threads") == 0)
+    {
+        checksum = runShortThreads();
+    }
+    else if (strcmp(workload, "onepage") == 0)
+    {
+        checksum = runParallel(3);
+    }
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%s: checksum %lu\n", workload, checksum);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#!/bin/bash
+
+# usage: ./run_bench.sh <pintool.so> [-w "workloads"] [-m "modes"] [-t threads]
+#                       [-n scale] [-a "tool arguments"] [-o results]
+#
+# Runs every microbench workload natively and under the pintool in every
+# mode, and appends one JSON line per workload and mode to the results file
+# (default bench_results.jsonl) and stdout:
+#
+# {"workload":"stream","mode":"trace","threads":4,"native_s":0.412,
+#  "pin_s":12.310,"slowdown":29.9,"instructions":...,"mips":...,
+#  "thread_mips":[...],"bytes":...,"bytes_per_ins":...}
+#
+# The instruction counts are the per-thread counts of the -o dependency
+# record. MIPS are instructions per second of wall time of the whole
+# instrumented run. The bytes are all the streams the run wrote. Extra tool
+# arguments, e.g. -a "-sink xz", apply to every mode. Needs pin on the PATH
+# (see env.sh).
+
+set -e
+
+if [ $# -lt 1 ]
+then
+    echo "usage: $0 <pintool.so> [-w workloads] [-m modes] [-t threads] [-n scale] [-a tool arguments] [-o results]" >&2
+    exit 1
+fi
+
+TOOL=$(realpath "$1")
+shift
+
+BENCH=$(cd "$(dirname "$0")" && pwd)/microbench
+
+WORKLOADS="branchy stream lock threads"
+MODES="trace bbv sharing cachefilter profile"
+THREADS=4
+SCALE=1
+TOOL_ARGS=""
+RESULTS=bench_results.jsonl
+
+while getopts "w:m:t:n:a:o:" opt
+do
+    case ${opt} in
+        w) WORKLOADS=${OPTARG} ;;
+        m) MODES=${OPTARG} ;;
+        t) THREADS=${OPTARG} ;;
+        n) SCALE=${OPTARG} ;;
+        a) TOOL_ARGS=${OPTARG} ;;
+        o) RESULTS=${OPTARG} ;;
+        *) exit 1 ;;
+    esac
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf "${WORK}"' EXIT
+
+now()
+{
+    date +%s.%N
+}
+
+elapsed()
+{
+    awk -v begin="$1" -v end="$2" 'BEGIN { printf "%.3f", end - begin }'
+}
+
+for workload in ${WORKLOADS}
+do
+    begin=$(now)
+    "${BENCH}" "${workload}" -t "${THREADS}" -n "${SCALE}" > /dev/null
+    native=$(elapsed "${begin}" "$(now)")
+
+    for mode in ${MODES}
+    do
+        rm -rf "${WORK:?}"/*
+
+        begin=$(now)
+        # shellcheck disable=SC2086
+        pin -t "${TOOL}" -mode "${mode}" -sink file -out_dir "${WORK}/out" -o "${WORK}/dependency.jsonl" ${TOOL_ARGS} \
+            -- "${BENCH}" "${workload}" -t "${THREADS}" -n "${SCALE}" > /dev/null
+        instrumented=$(elapsed "${begin}" "$(now)")
+
+        counts=$(grep '"event":"finish"' "${WORK}/dependency.jsonl" | sed 's/.*"instructions":\([0-9]*\).*/\1/' | tr '\n' ' ')
+        bytes=$(find "${WORK}/out" -type f -printf '%s\n' | awk '{ total += $1 } END { printf "%.0f", total }')
+
+        echo "${counts}" | awk -v workload="${workload}" -v mode="${mode}" -v threads="${THREADS}" \
+            -v native="${native}" -v pin="${instrumented}" -v bytes="${bytes}" '{
+            total = 0
+            list = ""
+            for (i = 1; i <= NF; i++)
+            {
+                total += $i
+                list = list ((i > 1) ? "," : "") sprintf("%.2f", $i / pin / 1e6)
+            }
+            printf "{\"workload\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"native_s\":%.3f,\"pin_s\":%.3f,\"slowdown\":%.1f,", \
+                workload, mode, threads, native, pin, (native > 0) ? pin / native : 0
+            printf "\"instructions\":%.0f,\"mips\":%.2f,\"thread_mips\":[%s],\"bytes\":%.0f,\"bytes_per_ins\":%.3f}\n", \
+                total, total / pin / 1e6, list, bytes, (total > 0) ? bytes / total : 0
+        }' | tee -a "${RESULTS}"
+    done
+done
@@ -1,9 +1,29 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <map>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pin.H"
 
+// the record format and its encoders, shared with tools/
+#include "trace_format.h"
+
+#if defined(TRACER_WITH_LZMA)
+#include <lzma.h>
+#endif
+
+#if defined(TRACER_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
 using std::ofstream;
 using std::cout;
 using std::cerr;
@@ -12,22 +32,110 @@ using std::endl;
 using std::map;
 using std::pair;
 using std::setw;
+using std::vector;
 
 // key for accessing TLS storage in the threads. initialized once in main()
 static  TLS_KEY mlog_key = INVALID_TLS_KEY;
 
-PIN_LOCK global_lock;
+// tool register holding each thread's MLOG pointer, passed to the analysis
+// routines with IARG_REG_VALUE so they do not have to look up the TLS
+static REG mlog_reg = REG_INVALID();
+
+class MLOG;
+class CacheModel;
+class thread_data_t;
+struct pages_thread_t;
+struct page_count_t;
+
+// Array indexed by a dense ID (OS tid, logical thread number) that grows in
+// chunks of 2^CHUNK_BITS slots without taking a lock. Slots never move, so
+// pointers to them stay valid.
+template <class T, UINT32 CHUNK_BITS, UINT32 MAX_CHUNKS>
+class ChunkedTable
+{
+  public:
+
+    ChunkedTable()
+    {
+        for (UINT32 i = 0; i < MAX_CHUNKS; i++)
+        {
+            chunks[i] = NULL;
+        }
+    }
+
+    // slot for index, allocated on first use; NULL if index is out of range
+    T* slot(UINT64 index)
+    {
+        UINT64 chunk = index >> CHUNK_BITS;
+
+        if (chunk >= MAX_CHUNKS)
+        {
+            return NULL;
+        }
+
+        if (chunks[chunk] == NULL)
+        {
+            T* fresh = new T[1 << CHUNK_BITS]();
+
+            // another thread may have been faster
+            if ( ! ATOMIC::OPS::CompareAndDidSwap<T*>(&chunks[chunk], NULL, fresh))
+            {
+                delete[] fresh;
+            }
+        }
+
+        return &chunks[chunk][index & ((1 << CHUNK_BITS) - 1)];
+    }
+
+    // slot for index if its chunk exists, never allocates
+    T* find(UINT64 index) const
+    {
+        UINT64 chunk = index >> CHUNK_BITS;
+
+        if ((chunk >= MAX_CHUNKS) || (chunks[chunk] == NULL))
+        {
+            return NULL;
+        }
+
+        return &chunks[chunk][index & ((1 << CHUNK_BITS) - 1)];
+    }
+
+  private:
+
+    T* volatile chunks[MAX_CHUNKS];
+};
+
+// Base of the hash table shards that -mode sharing and -mode pages keep in
+// arrays, each behind its own lock. The alignment passes to the derived
+// shards, so every shard starts on a cache line of its own and the locks of
+// neighbouring shards do not falsely share.
+struct __attribute__((aligned(64))) locked_shard_t
+{
+    PIN_LOCK lock;
+};
 
-map<UINT64, UINT64> threadMapDB;
+// OS tid -> MLOG of the thread, covers the kernel's maximum pid_max of 2^22.
+// A recycled OS tid simply points to the newer thread.
+ChunkedTable<MLOG*, 12, 1024> threadMapDB;
 
-void insertThreadMapDB(UINT64 OSID, UINT64 PINID)
+void insertThreadMapDB(OS_THREAD_ID OSID, MLOG *mlog)
 {
-    threadMapDB.insert(pair<UINT64, UINT64>(OSID, PINID));
+    MLOG **slot = threadMapDB.slot(OSID);
+
+    if (slot == NULL)
+    {
+        cerr << "Error: OS thread id " << OSID << " out of range" << endl;
+        PIN_ExitProcess(1);
+    }
+
+    *slot = mlog;
 }
 
-UINT64 queryThreadMapDB(UINT64 OSID)
+MLOG* queryThreadMapDB(OS_THREAD_ID OSID)
 {
-    return threadMapDB.find(OSID)->second;
+    MLOG **slot = threadMapDB.find(OSID);
+
+    return slot != NULL ? *slot : NULL;
 }
 
 struct ThreadDependencyNode
@@ -41,6 +149,7 @@ struct ThreadDependencyNode
 
 struct threadDependencyRecord
 {
+    BOOL valid;
     UINT64 parentThread;
     UINT64 pthreadCreateTime;
     UINT64 startTime;
@@ -48,28 +157,35 @@ struct threadDependencyRecord
     UINT64 insCount;
 };
 
-map<UINT64, threadDependencyRecord> threadDependencyDB;
+// indexed by logical thread number, each slot is only written by its thread
+ChunkedTable<threadDependencyRecord, 10, (1 << 14)> threadDependencyDB;
 
 void insertThreadDependencyDB(UINT64 childID, UINT64 parentID, UINT64 actualTime)
 {
-    threadDependencyRecord r;
-    r.parentThread = parentID;
-    r.pthreadCreateTime = 0; // pthreadTime;
-    r.startTime = actualTime;
-    r.terminateTime = 0;
-    r.insCount = 0;
+    threadDependencyRecord *r = threadDependencyDB.slot(childID);
+
+    if (r == NULL)
+    {
+        cerr << "Error: too many threads for the dependency record" << endl;
+        PIN_ExitProcess(1);
+    }
 
-    threadDependencyDB.insert(pair<UINT64, threadDependencyRecord>(childID, r));
+    r->parentThread = parentID;
+    r->pthreadCreateTime = 0; // pthreadTime;
+    r->startTime = actualTime;
+    r->terminateTime = 0;
+    r->insCount = 0;
+    r->valid = TRUE;
 }
 
 void updateThreadDependencyDB(UINT64 childID, UINT64 terminateInsCount)
 {
-    threadDependencyDB.find(childID)->second.terminateTime = terminateInsCount;
+    threadDependencyDB.find(childID)->terminateTime = terminateInsCount;
 }
 
 void updateThreadDependencyDBTerminateInsCount(UINT64 childID, UINT64 num)
 {
-    threadDependencyDB.find(childID)->second.insCount = num;
+    threadDependencyDB.find(childID)->insCount = num;
 }
 
 struct child_thread_record_node
@@ -86,447 +202,4203 @@ struct child_thread_record_node
 
 #define PAD_SIZE 8
 
-#define NUM_INSTR_DESTINATIONS 2
-#define NUM_INSTR_SOURCES 4
-
-typedef struct trace_instr_format {
-    unsigned long long int ip;  // instruction pointer (program counter) value
-
-    unsigned char is_branch;    // is this branch
-    unsigned char branch_taken; // if so, is this taken
+/* ===================================================================== */
+/* Output sinks                                                          */
+/* ===================================================================== */
 
-    unsigned char destination_registers[NUM_INSTR_DESTINATIONS]; // output registers
-    unsigned char source_registers[NUM_INSTR_SOURCES];           // input registers
+// A sink is where one stream (e.g. the trace of one logical thread) ends up.
+// The writer fills a staging buffer obtained from the sink and hands it back
+// with write(), which returns the buffer to fill next. Compressed sinks swap
+// buffers so the compression can run on the internal threads meanwhile.
 
-    unsigned long long int destination_memory[NUM_INSTR_DESTINATIONS]; // output memory
-    unsigned long long int source_memory[NUM_INSTR_SOURCES];           // input memory
-    
-} trace_instr_format_t; 
+#define SINK_FIFO 0
+#define SINK_FILE 1
+#define SINK_XZ   2
+#define SINK_ZSTD 3
 
-/*
- * MLOG - thread specific data that is not handled by the buffering API.
- */
-class MLOG
+class TraceSink
 {
   public:
 
-    FILE *traceFile;
+    TraceSink(size_t size) : bufferBytes(size) {}
 
-    trace_instr_format_t trace;
+    virtual ~TraceSink() {}
 
-    UINT64 ip;
+    // staging buffer of bufferBytes bytes
+    virtual UINT8* openBuffer() = 0;
 
-    UINT64 insNum;
+    // consume the first bytes of buffer, returns the buffer to fill next
+    virtual UINT8* write(UINT8 *buffer, size_t bytes) = 0;
 
-    UINT64 parentThreadID;
+    // write out what is left and close the stream, the sink is gone afterwards
+    virtual void close(UINT8 *buffer, size_t bytes) = 0;
 
-    ThreadDependencyNode* threadDependencyNode;
+    size_t bufferBytes;
+};
 
-    PIN_MUTEX threadLockMutex;    
+// plain file or FIFO
+class FileSink : public TraceSink
+{
+  public:
 
-    child_thread_record_node *child_thread_record_root_node;
+    FileSink(FILE *f, size_t size) : TraceSink(size), file(f), buffer(NULL) {}
 
-    UINT8 _pad[PAD_SIZE];
+    UINT8* openBuffer();
 
-    void insertChildThreadRecordNode(
-        UINT64 parent_thread_pthread_create_ins_num,        
-        UINT32 parent_thread_ID
-    );
+    UINT8* write(UINT8 *buffer, size_t bytes);
 
-    void updateChildTHreadRecordNode(
-        UINT64 parent_thread_thread_start_ins_num,
-        UINT32 pin_assigned_thread_ID,
-        ADDRINT pthread_t_value
-    );
+    void close(UINT8 *buffer, size_t bytes);
 
-    void insertSpaceInThreadCreation();
+    FILE *file;
 
-    void popSpaceInThreadCreation(UINT64 parent, UINT64 child);
+    UINT8 *buffer;
 };
 
-void MLOG::insertChildThreadRecordNode(
-    UINT64 parent_thread_pthread_create_ins_num,
-    UINT32 parent_thread_ID
-    )
-{   
-    PIN_MutexLock(&threadLockMutex);
+UINT8* FileSink::openBuffer()
+{
+    buffer = new UINT8[bufferBytes];
+    return buffer;
+}
 
-    if (child_thread_record_root_node == NULL)
+UINT8* FileSink::write(UINT8 *data, size_t bytes)
+{
+    if (fwrite(data, 1, bytes, file) != bytes)
     {
-        child_thread_record_root_node = new child_thread_record_node;
-        child_thread_record_root_node->parent_thread_pthread_create_ins = parent_thread_pthread_create_ins_num;        
-        child_thread_record_root_node->pin_assigned_parent_thread_ID = parent_thread_ID;
-        child_thread_record_root_node->next = NULL;
+        cerr << "Error: could not write to output trace file." << endl;
+        PIN_ExitProcess(1);
     }
-    else
-    {
-        child_thread_record_node* tmpp = child_thread_record_root_node;
 
-        while (tmpp->next != NULL)
-        {
-            tmpp = tmpp->next;            
-        }
+    return data;
+}
 
-        tmpp->next = new child_thread_record_node;
-        tmpp = tmpp->next;
-        tmpp->parent_thread_pthread_create_ins = parent_thread_pthread_create_ins_num;        
-        tmpp->pin_assigned_parent_thread_ID = parent_thread_ID;
-        tmpp->next = NULL;
-    }    
+void FileSink::close(UINT8 *data, size_t bytes)
+{
+    write(data, bytes);
 
-    PIN_MutexUnlock(&threadLockMutex);
+    fclose(file);
+
+    delete[] buffer;
+    delete this;
 }
 
-void MLOG::updateChildTHreadRecordNode(
-        UINT64 parent_thread_thread_start_ins_num,
-        UINT32 assigned_thread_ID,
-        ADDRINT pthread_t_value
-    )
+/* ===================================================================== */
+/* In-process trace compression                                          */
+/* ===================================================================== */
+
+// Compressed sinks are fed by the application threads and compressed by a
+// pool of Pin internal threads. Every sink is pinned to one worker so that
+// its blocks are compressed in order without any per-stream locking.
+
+// number of staging buffers a thread may have in flight before it has to wait
+#define MAX_BUFFERS_PER_STREAM 4
+
+#define COMPRESS_OUT_SIZE (1 << 20)
+
+class CompressedSink : public TraceSink
 {
-    PIN_MutexLock(&threadLockMutex);
+  public:
 
-    child_thread_record_node* tmpp = child_thread_record_root_node;
+    CompressedSink(FILE *f, UINT32 kind, size_t size);
 
-    int i = 0;
+    UINT8* openBuffer();
 
-    while ((tmpp != NULL) && (tmpp->next != NULL) && (tmpp->pthread_t_value != 0))
-    {
-        tmpp = tmpp->next;     
-        i++;           
+    UINT8* write(UINT8 *buffer, size_t bytes);
 
-        if (((tmpp->pthread_t_value)) == pthread_t_value)
-        {
-            break;
-        }
-    }
+    void close(UINT8 *buffer, size_t bytes);
 
-    tmpp->parent_thread_thread_start_ins = parent_thread_thread_start_ins_num;
-    tmpp->pin_assigned_thread_ID = assigned_thread_ID;        
+    // called by the owning worker only
+    void compress(const void *data, size_t size, BOOL finish);
 
-    PIN_MutexUnlock(&threadLockMutex);
-}
+    void finish();
 
-void MLOG::insertSpaceInThreadCreation()
-{
-    PIN_MutexLock(&threadLockMutex);
-    if (threadDependencyNode == NULL)
-    {
-        threadDependencyNode = new ThreadDependencyNode;
-        threadDependencyNode->threadPINID = 0;
-        threadDependencyNode->instructionNumber = insNum;
-        threadDependencyNode->next = NULL;
-    }
-    else
-    {
-        ThreadDependencyNode* tmpp = threadDependencyNode;
+    void releaseBuffer(UINT8 *buffer);
 
-        while (tmpp->next != NULL)
-        {
-            tmpp = tmpp->next;
-        }
-        
-        tmpp->next = new ThreadDependencyNode;
-        tmpp = tmpp->next;
-        tmpp->threadPINID = 0;
-        tmpp->instructionNumber = insNum;
-        tmpp->next = NULL;
-    }
-    PIN_MutexUnlock(&threadLockMutex);
-}
+    FILE *file;
 
-void MLOG::popSpaceInThreadCreation(UINT64 parent, UINT64 child)
-{
-    // PIN_MutexLock(&threadLockMutex);    
-    // // ThreadDependencyNode* tmpp = threadDependencyNode;
-    // // cout << "there 5" << endl;
-    // // threadDependencyNode = threadDependencyNode->next;    
-    // // // threadDependency << "Thread " 
-    // // // << setw(5) << child 
-    // // // << " started by thread " << setw(5) << parent << " with pthread_create"
-    // // // << " at instruction " << setw(12) << dec << tmpp->instructionNumber 
-    // // // << ", actually started at instruction " << setw(12) << insNum
-    // // // << endl;
+    UINT32 codec;
 
-    // // delete tmpp;
+    UINT32 worker;
 
-    // PIN_MutexUnlock(&threadLockMutex);
+#if defined(TRACER_WITH_LZMA)
+    lzma_stream xz;
+#endif
 
-    // PIN_GetLock(&global_lock, child);
+#if defined(TRACER_WITH_ZSTD)
+    ZSTD_CStream *zstd;
+#endif
 
-    insertThreadDependencyDB(child, parent, insNum);
+    UINT8 *outBuffer;
 
-    // PIN_ReleaseLock(&global_lock);
-}
+    // staging buffers handed back by the worker once compressed
+    PIN_MUTEX freeLock;
 
-KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
-    "o", "", "specify dependency record file name");
+    PIN_SEMAPHORE bufferReturned;
 
-ofstream threadDependency;
+    vector<UINT8*> freeBuffers;
 
-// Force each thread's data to be in its own data cache line so that
-// multiple threads do not contend for the same data cache line.
-// This avoids the false sharing problem.
-#define PADSIZE 56  // 64 byte line size: 64-8
+    UINT32 allocatedBuffers;
+};
 
-// a running count of the instructions
-class thread_data_t
+struct CompressionJob
 {
-  public:
-    thread_data_t() : _count(0) {}
-    UINT64 _count;
-    UINT8 _pad[PADSIZE];
+    CompressedSink *sink;
+    UINT8 *buffer;
+    size_t bytes;
+    BOOL finish;
+    struct CompressionJob* next;
 };
 
-void BeginInstruction(VOID *ip, UINT32 op_code, THREADID threadid)
-{                  
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, threadid));
+class CompressionWorker
+{
+  public:
 
-    mlog->insNum += 1;
-    mlog->ip = (unsigned long long int)ip;
+    PIN_MUTEX queueLock;
 
-    // reset the current instruction
-    mlog->trace.ip = (unsigned long long int)ip;
+    PIN_SEMAPHORE jobReady;
 
-    mlog->trace.is_branch = 0;
-    mlog->trace.branch_taken = 0;
+    PIN_SEMAPHORE drained;
 
-    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++) 
-    {
-        mlog->trace.destination_registers[i] = 0;
-        mlog->trace.destination_memory[i] = 0;
-    }
+    CompressionJob *head;
 
-    for(int i=0; i<NUM_INSTR_SOURCES; i++) 
-    {
-        mlog->trace.source_registers[i] = 0;
-        mlog->trace.source_memory[i] = 0;
-    }               
-}
+    CompressionJob *tail;
 
-void EndInstruction(THREADID threadid)
-{             
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData( mlog_key, threadid));
-    
-    fwrite(&(mlog->trace), sizeof(trace_instr_format_t), 1, mlog->traceFile);
-}
+    BOOL exiting;
 
-void BranchOrNot(UINT32 taken, THREADID threadid)
-{       
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData( mlog_key, threadid));
+    PIN_THREAD_UID uid;
+};
 
-    mlog->trace.is_branch = 1;
+KNOB<UINT32> KnobCompressThreads(KNOB_MODE_WRITEONCE, "pintool",
+    "compress_threads", "4", "number of internal threads used for trace compression");
 
-    if(taken != 0)
-    {
-        mlog->trace.branch_taken = 1;        
-    }
-}
+KNOB<UINT32> KnobCompressLevel(KNOB_MODE_WRITEONCE, "pintool",
+    "compress_level", "0", "xz preset or zstd level used for trace compression");
 
-void RegRead(UINT32 i, UINT32 index, THREADID threadid)
-{          
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData( mlog_key, threadid));
+vector<CompressionWorker*> compressionWorkers;
+
+UINT32 nextCompressionWorker = 0;
+
+void SubmitCompressionJob(CompressedSink *sink, UINT8 *buffer, size_t bytes, BOOL finish);
+
+CompressedSink::CompressedSink(FILE *f, UINT32 kind, size_t size)
+  : TraceSink(size), file(f), codec(kind), allocatedBuffers(0)
+{
+    outBuffer = new UINT8[COMPRESS_OUT_SIZE];
 
-    REG r = (REG)i;   
+    PIN_MutexInit(&freeLock);
+    PIN_SemaphoreInit(&bufferReturned);
 
-    // check to see if this register is already in the list
-    int already_found = 0;
-    for(int i=0; i<NUM_INSTR_SOURCES; i++)
+#if defined(TRACER_WITH_LZMA)
+    if (codec == SINK_XZ)
     {
-        if(mlog->trace.source_registers[i] == ((unsigned char)r))
+        lzma_stream init = LZMA_STREAM_INIT;
+        xz = init;
+
+        if (lzma_easy_encoder(&xz, KnobCompressLevel.Value(), LZMA_CHECK_CRC64) != LZMA_OK)
         {
-            already_found = 1;
-            break;
+            cerr << "Error: could not initialize xz encoder." << endl;
+            PIN_ExitProcess(1);
         }
     }
-    if(already_found == 0)
+#endif
+
+#if defined(TRACER_WITH_ZSTD)
+    if (codec == SINK_ZSTD)
+    {
+        zstd = ZSTD_createCStream();
+        ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, KnobCompressLevel.Value());
+    }
+#endif
+
+    // spread the sinks over the workers round-robin
+    worker = ATOMIC::OPS::Increment<UINT32>(&nextCompressionWorker, 1) % compressionWorkers.size();
+}
+
+// Get an empty staging buffer, waiting for the worker if the thread already
+// has MAX_BUFFERS_PER_STREAM buffers queued for compression.
+UINT8* CompressedSink::openBuffer()
+{
+    while (TRUE)
     {
-        for(int i=0; i<NUM_INSTR_SOURCES; i++)
+        PIN_MutexLock(&freeLock);
+
+        if ( ! freeBuffers.empty())
         {
-            if(mlog->trace.source_registers[i] == 0)
-            {
-                mlog->trace.source_registers[i] = (unsigned char)r;
-                break;
-            }
+            UINT8 *buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            PIN_MutexUnlock(&freeLock);
+            return buffer;
         }
-    }    
-}
 
-void RegWrite(REG i, UINT32 index, THREADID threadid)
-{          
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData( mlog_key, threadid));
+        if (allocatedBuffers < MAX_BUFFERS_PER_STREAM)
+        {
+            allocatedBuffers++;
+            PIN_MutexUnlock(&freeLock);
+            return new UINT8[bufferBytes];
+        }
 
-    REG r = (REG)i;
+        PIN_SemaphoreClear(&bufferReturned);
+        PIN_MutexUnlock(&freeLock);
 
-    /*
-    if(r == 26)
-    {
-    // 26 is the IP, which is read and written by branches
-    return;
+        PIN_SemaphoreWait(&bufferReturned);
     }
-    */
+}
+
+void CompressedSink::releaseBuffer(UINT8 *buffer)
+{
+    PIN_MutexLock(&freeLock);
+    freeBuffers.push_back(buffer);
+    PIN_SemaphoreSet(&bufferReturned);
+    PIN_MutexUnlock(&freeLock);
+}
 
-    //cout << "<" << r << " " << REG_StringShort((REG)r) << "> ";
-    //cout << "<" << REG_StringShort((REG)r) << "> ";
+UINT8* CompressedSink::write(UINT8 *buffer, size_t bytes)
+{
+    SubmitCompressionJob(this, buffer, bytes, FALSE);
+
+    return openBuffer();
+}
 
-    //printf("<%d> ", (int)r);
+void CompressedSink::close(UINT8 *buffer, size_t bytes)
+{
+    // hand over the partially filled buffer together with the end of stream
+    SubmitCompressionJob(this, buffer, bytes, TRUE);
+}
 
-    int already_found = 0;
-    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+void WriteCompressed(FILE *file, const UINT8 *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size)
     {
-        if(mlog->trace.destination_registers[i] == ((unsigned char)r))
-        {
-            already_found = 1;
-            break;
-        }
+        cerr << "Error: could not write to compressed trace file." << endl;
+        PIN_ExitProcess(1);
     }
-    if(already_found == 0)
+}
+
+// Feed one block to the encoder, finishing the stream when asked.
+void CompressedSink::compress(const void *data, size_t size, BOOL finish)
+{
+#if defined(TRACER_WITH_LZMA)
+    if (codec == SINK_XZ)
     {
-        for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+        xz.next_in = static_cast<const uint8_t*>(data);
+        xz.avail_in = size;
+
+        lzma_action action = finish ? LZMA_FINISH : LZMA_RUN;
+
+        while (TRUE)
         {
-            if(mlog->trace.destination_registers[i] == 0)
+            xz.next_out = outBuffer;
+            xz.avail_out = COMPRESS_OUT_SIZE;
+
+            lzma_ret ret = lzma_code(&xz, action);
+
+            if ((ret != LZMA_OK) && (ret != LZMA_STREAM_END))
             {
-                mlog->trace.destination_registers[i] = (unsigned char)r;
-                break;
+                cerr << "Error: xz compression failed (" << ret << ")" << endl;
+                PIN_ExitProcess(1);
             }
-        }
-    }       
-}
 
-void MemoryRead(VOID* addr, UINT32 index, UINT32 read_size, THREADID threadid)
-{         
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData( mlog_key, threadid));
+            WriteCompressed(file, outBuffer, COMPRESS_OUT_SIZE - xz.avail_out);
 
-    // check to see if this memory read location is already in the list
-    int already_found = 0;
-    for(int i=0; i<NUM_INSTR_SOURCES; i++)
-    {
-        if(mlog->trace.source_memory[i] == ((unsigned long long int)addr))
-        {
-            already_found = 1;
-            break;
-        }
-    }
-    if(already_found == 0)
-    {
-        for(int i=0; i<NUM_INSTR_SOURCES; i++)
-        {
-            if(mlog->trace.source_memory[i] == 0)
+            if (finish ? (ret == LZMA_STREAM_END) : (xz.avail_in == 0))
             {
-                mlog->trace.source_memory[i] = (unsigned long long int)addr;
                 break;
             }
         }
+        return;
     }
-}
-
-void MemoryWrite(VOID* addr, UINT32 index, THREADID threadid)
-{               
-    MLOG* mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, threadid));
+#endif
 
-    // check to see if this memory write location is already in the list
-    int already_found = 0;
-    for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
-    {
-        if(mlog->trace.destination_memory[i] == ((unsigned long long int)addr))
-        {
-            already_found = 1;
-            break;
-        }
-    }
-    if(already_found == 0)
+#if defined(TRACER_WITH_ZSTD)
+    if (codec == SINK_ZSTD)
     {
-        for(int i=0; i<NUM_INSTR_DESTINATIONS; i++)
+        ZSTD_inBuffer in = { data, size, 0 };
+
+        ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+
+        while (TRUE)
         {
-            if(mlog->trace.destination_memory[i] == 0)
+            ZSTD_outBuffer out = { outBuffer, COMPRESS_OUT_SIZE, 0 };
+
+            size_t remaining = ZSTD_compressStream2(zstd, &out, &in, mode);
+
+            if (ZSTD_isError(remaining))
+            {
+                cerr << "Error: zstd compression failed (" << ZSTD_getErrorName(remaining) << ")" << endl;
+                PIN_ExitProcess(1);
+            }
+
+            WriteCompressed(file, outBuffer, out.pos);
+
+            if (finish ? (remaining == 0) : (in.pos == in.size))
             {
-                mlog->trace.destination_memory[i] = (unsigned long long int)addr;
                 break;
             }
         }
-    }      
+        return;
+    }
+#endif
 }
 
-void Instruction(INS ins, VOID *v)
+void CompressedSink::finish()
 {
-    // begin each instruction with this function
-    UINT32 opcode = INS_Opcode(ins);
+    compress(NULL, 0, TRUE);
+
+#if defined(TRACER_WITH_LZMA)
+    if (codec == SINK_XZ)
+    {
+        lzma_end(&xz);
+    }
+#endif
+
+#if defined(TRACER_WITH_ZSTD)
+    if (codec == SINK_ZSTD)
+    {
+        ZSTD_freeCStream(zstd);
+    }
+#endif
+
+    fclose(file);
+
+    // every earlier job of this sink has run, so all buffers are back
+    for (size_t i = 0; i < freeBuffers.size(); i++)
+    {
+        delete[] freeBuffers[i];
+    }
+
+    delete[] outBuffer;
+
+    PIN_SemaphoreFini(&bufferReturned);
+    PIN_MutexFini(&freeLock);
+
+    delete this;
+}
+
+void RunCompressionJob(CompressionJob *job)
+{
+    if (job->buffer != NULL)
+    {
+        job->sink->compress(job->buffer, job->bytes, FALSE);
+        job->sink->releaseBuffer(job->buffer);
+    }
+
+    if (job->finish)
+    {
+        job->sink->finish();
+    }
+
+    delete job;
+}
+
+// Queue a filled buffer (or the end of the stream when finish is set). Once
+// the pool has shut down the job is run on the calling thread instead.
+void SubmitCompressionJob(CompressedSink *sink, UINT8 *buffer, size_t bytes, BOOL finish)
+{
+    CompressionJob *job = new CompressionJob;
+    job->sink = sink;
+    job->buffer = buffer;
+    job->bytes = bytes;
+    job->finish = finish;
+    job->next = NULL;
+
+    CompressionWorker *worker = compressionWorkers[sink->worker];
+
+    PIN_MutexLock(&worker->queueLock);
+
+    if (worker->exiting)
+    {
+        PIN_MutexUnlock(&worker->queueLock);
+
+        // keep the stream in order: let the worker drain what it already has
+        PIN_SemaphoreWait(&worker->drained);
+        RunCompressionJob(job);
+        return;
+    }
+
+    if (worker->tail == NULL)
+    {
+        worker->head = job;
+    }
+    else
+    {
+        worker->tail->next = job;
+    }
+    worker->tail = job;
+
+    PIN_SemaphoreSet(&worker->jobReady);
+    PIN_MutexUnlock(&worker->queueLock);
+}
+
+VOID CompressionThread(VOID *arg)
+{
+    CompressionWorker *worker = static_cast<CompressionWorker*>(arg);
+
+    while (TRUE)
+    {
+        PIN_MutexLock(&worker->queueLock);
+
+        CompressionJob *job = worker->head;
+
+        if (job == NULL)
+        {
+            if (worker->exiting)
+            {
+                PIN_MutexUnlock(&worker->queueLock);
+                break;
+            }
+
+            PIN_SemaphoreClear(&worker->jobReady);
+            PIN_MutexUnlock(&worker->queueLock);
+
+            PIN_SemaphoreWait(&worker->jobReady);
+            continue;
+        }
+
+        worker->head = job->next;
+        if (worker->head == NULL)
+        {
+            worker->tail = NULL;
+        }
+
+        PIN_MutexUnlock(&worker->queueLock);
+
+        RunCompressionJob(job);
+    }
+
+    PIN_SemaphoreSet(&worker->drained);
+}
+
+void StartCompressionWorkers(UINT32 count)
+{
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    for (UINT32 i = 0; i < count; i++)
+    {
+        CompressionWorker *worker = new CompressionWorker;
+
+        PIN_MutexInit(&worker->queueLock);
+        PIN_SemaphoreInit(&worker->jobReady);
+        PIN_SemaphoreInit(&worker->drained);
+        worker->head = NULL;
+        worker->tail = NULL;
+        worker->exiting = FALSE;
+
+        compressionWorkers.push_back(worker);
+
+        if (PIN_SpawnInternalThread(CompressionThread, worker, 0, &worker->uid) == INVALID_THREADID)
+        {
+            cerr << "Error: could not spawn compression thread." << endl;
+            PIN_ExitProcess(1);
+        }
+    }
+}
+
+// Internal threads have to be gone before Pin runs the Fini callbacks, so
+// the workers finish their queues here. Sinks closed later (e.g. by the
+// main thread's ThreadFini) are compressed on the closing thread.
+VOID StopCompressionWorkers(VOID *v)
+{
+    for (size_t i = 0; i < compressionWorkers.size(); i++)
+    {
+        CompressionWorker *worker = compressionWorkers[i];
+
+        PIN_MutexLock(&worker->queueLock);
+        worker->exiting = TRUE;
+        PIN_SemaphoreSet(&worker->jobReady);
+        PIN_MutexUnlock(&worker->queueLock);
+    }
+
+    for (size_t i = 0; i < compressionWorkers.size(); i++)
+    {
+        PIN_WaitForThreadTermination(compressionWorkers[i]->uid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+}
+
+/* ===================================================================== */
+/* Asynchronous writers                                                  */
+/* ===================================================================== */
+
+// With -writer_threads the file and FIFO sinks do not write on the
+// application threads. Every such sink owns a single-producer/single-consumer
+// ring of staging buffers: the application thread fills the slot at head and
+// publishes it, and an internal writer thread writes the slots between tail
+// and head to the file and hands them back. The application thread only
+// waits when its whole ring is queued, e.g. behind a slow FIFO reader. These
+// waits are counted and reported at exit.
+
+KNOB<UINT32> KnobWriterThreads(KNOB_MODE_WRITEONCE, "pintool",
+    "writer_threads", "0", "number of internal threads writing the file and fifo sinks, 0 writes on the application threads");
+
+KNOB<UINT32> KnobWriterRing(KNOB_MODE_WRITEONCE, "pintool",
+    "writer_ring", "8", "staging buffers per stream queued for the writer threads before the application thread has to wait");
+
+class AsyncSink;
+
+class AsyncWriter
+{
+  public:
+
+    // sinks served by this writer, added by the application threads
+    PIN_MUTEX lock;
+
+    vector<AsyncSink*> sinks;
+
+    PIN_SEMAPHORE work;
+
+    // set once the writer has written everything published before it exited
+    PIN_SEMAPHORE drained;
+
+    UINT32 exiting;
+
+    PIN_THREAD_UID uid;
+};
+
+struct async_slot_t
+{
+    UINT8 *buffer;
+    size_t bytes;
+    BOOL last;
+};
+
+class AsyncSink : public TraceSink
+{
+  public:
+
+    AsyncSink(FILE *f, size_t size);
+
+    UINT8* openBuffer();
+
+    UINT8* write(UINT8 *buffer, size_t bytes);
+
+    void close(UINT8 *buffer, size_t bytes);
+
+    // consumer side: write out the published slots, FALSE if there were none
+    BOOL drain();
+
+    FILE *file;
+
+    AsyncWriter *writer;
+
+    vector<async_slot_t> slots;
+
+    // only the application thread moves head, only the writer moves tail
+    UINT64 head;
+
+    UINT8 _headPad[64];
+
+    UINT64 tail;
+
+    UINT8 _tailPad[64];
+
+    // set while the application thread publishes, see BeginPublish
+    UINT32 publishing;
+
+    PIN_SEMAPHORE slotFreed;
+
+    // back-pressure, kept by the application thread
+    UINT64 fullWaits;
+
+    UINT64 waitNs;
+
+    UINT64 maxQueued;
+
+  private:
+
+    BOOL beginPublish();
+
+    void publish(size_t bytes, BOOL last);
+
+    void finish();
+};
+
+vector<AsyncWriter*> asyncWriters;
+
+UINT32 nextAsyncWriter = 0;
+
+BOOL asyncWritersStopped = FALSE;
+
+// back-pressure of the closed sinks, under async_stats_lock
+PIN_MUTEX async_stats_lock;
+
+UINT64 asyncStreams = 0;
+
+UINT64 asyncBuffers = 0;
+
+UINT64 asyncFullWaits = 0;
+
+UINT64 asyncWaitNs = 0;
+
+UINT64 asyncMaxQueued = 0;
+
+UINT64 NowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void WriteAsyncSlot(FILE *file, const UINT8 *data, size_t bytes)
+{
+    if (fwrite(data, 1, bytes, file) != bytes)
+    {
+        cerr << "Error: could not write to output trace file." << endl;
+        PIN_ExitProcess(1);
+    }
+}
+
+AsyncSink::AsyncSink(FILE *f, size_t size)
+  : TraceSink(size), file(f), head(0), tail(0), publishing(0), fullWaits(0), waitNs(0), maxQueued(0)
+{
+    const UINT32 slotCount = (KnobWriterRing.Value() > 0) ? KnobWriterRing.Value() : 1;
+
+    slots.resize(slotCount);
+
+    for (UINT32 i = 0; i < slotCount; i++)
+    {
+        slots[i].buffer = new UINT8[bufferBytes];
+        slots[i].bytes = 0;
+        slots[i].last = FALSE;
+    }
+
+    PIN_SemaphoreInit(&slotFreed);
+
+    // spread the sinks over the writers round-robin
+    writer = asyncWriters[ATOMIC::OPS::Increment<UINT32>(&nextAsyncWriter, 1) % asyncWriters.size()];
+
+    PIN_MutexLock(&writer->lock);
+    writer->sinks.push_back(this);
+    PIN_MutexUnlock(&writer->lock);
+}
+
+// Wait for the writer to free the slot at head if the ring is full.
+UINT8* AsyncSink::openBuffer()
+{
+    const UINT64 slotCount = slots.size();
+
+    if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == slotCount)
+    {
+        const UINT64 begin = NowNs();
+
+        fullWaits++;
+
+        while (TRUE)
+        {
+            PIN_SemaphoreClear(&slotFreed);
+
+            if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) < slotCount)
+            {
+                break;
+            }
+
+            PIN_SemaphoreWait(&slotFreed);
+        }
+
+        waitNs += NowNs() - begin;
+    }
+
+    return slots[head % slotCount].buffer;
+}
+
+// Announce a publish, or return FALSE once the writer is gone and the sink
+// has to write for itself. The writer waits for announced publishes before
+// its last pass, so nothing published can be missed.
+BOOL AsyncSink::beginPublish()
+{
+    __atomic_store_n(&publishing, 1, __ATOMIC_SEQ_CST);
+
+    if ( ! __atomic_load_n(&writer->exiting, __ATOMIC_SEQ_CST))
+    {
+        return TRUE;
+    }
+
+    __atomic_store_n(&publishing, 0, __ATOMIC_SEQ_CST);
+
+    PIN_SemaphoreWait(&writer->drained);
+
+    return FALSE;
+}
+
+void AsyncSink::publish(size_t bytes, BOOL last)
+{
+    async_slot_t &slot = slots[head % slots.size()];
+
+    slot.bytes = bytes;
+    slot.last = last;
+
+    const UINT64 queued = head + 1 - __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+    if (queued > maxQueued)
+    {
+        maxQueued = queued;
+    }
+
+    AsyncWriter *w = writer;
+
+    __atomic_store_n(&head, head + 1, __ATOMIC_SEQ_CST);
+
+    // the writer does not delete the sink before this is cleared
+    __atomic_store_n(&publishing, 0, __ATOMIC_SEQ_CST);
+
+    PIN_SemaphoreSet(&w->work);
+}
+
+UINT8* AsyncSink::write(UINT8 *buffer, size_t bytes)
+{
+    if ( ! beginPublish())
+    {
+        WriteAsyncSlot(file, buffer, bytes);
+        return buffer;
+    }
+
+    publish(bytes, FALSE);
+
+    return openBuffer();
+}
+
+void AsyncSink::close(UINT8 *buffer, size_t bytes)
+{
+    if ( ! beginPublish())
+    {
+        WriteAsyncSlot(file, buffer, bytes);
+        finish();
+        return;
+    }
+
+    // the writer closes the file and deletes the sink
+    publish(bytes, TRUE);
+}
+
+BOOL AsyncSink::drain()
+{
+    const UINT64 available = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+    if (tail == available)
+    {
+        return FALSE;
+    }
+
+    while (tail < available)
+    {
+        const async_slot_t &slot = slots[tail % slots.size()];
+        const BOOL last = slot.last;
+
+        WriteAsyncSlot(file, slot.buffer, slot.bytes);
+
+        __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+        PIN_SemaphoreSet(&slotFreed);
+
+        if (last)
+        {
+            while (__atomic_load_n(&publishing, __ATOMIC_SEQ_CST))
+            {
+                PIN_Yield();
+            }
+
+            finish();
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+void AsyncSink::finish()
+{
+    fclose(file);
+
+    PIN_MutexLock(&async_stats_lock);
+    asyncStreams++;
+    asyncBuffers += head;
+    asyncFullWaits += fullWaits;
+    asyncWaitNs += waitNs;
+    asyncMaxQueued = (maxQueued > asyncMaxQueued) ? maxQueued : asyncMaxQueued;
+    PIN_MutexUnlock(&async_stats_lock);
+
+    PIN_MutexLock(&writer->lock);
+    writer->sinks.erase(std::find(writer->sinks.begin(), writer->sinks.end(), this));
+    PIN_MutexUnlock(&writer->lock);
+
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        delete[] slots[i].buffer;
+    }
+
+    PIN_SemaphoreFini(&slotFreed);
+
+    delete this;
+}
+
+VOID AsyncWriterThread(VOID *arg)
+{
+    AsyncWriter *writer = static_cast<AsyncWriter*>(arg);
+
+    vector<AsyncSink*> sinks;
+
+    while (TRUE)
+    {
+        PIN_SemaphoreClear(&writer->work);
+
+        const BOOL exiting = __atomic_load_n(&writer->exiting, __ATOMIC_SEQ_CST);
+
+        PIN_MutexLock(&writer->lock);
+        sinks = writer->sinks;
+        PIN_MutexUnlock(&writer->lock);
+
+        if (exiting)
+        {
+            // publishes that started before exiting was set
+            for (size_t i = 0; i < sinks.size(); i++)
+            {
+                while (__atomic_load_n(&sinks[i]->publishing, __ATOMIC_SEQ_CST))
+                {
+                    PIN_Yield();
+                }
+            }
+        }
+
+        BOOL wrote = FALSE;
+
+        for (size_t i = 0; i < sinks.size(); i++)
+        {
+            wrote = sinks[i]->drain() || wrote;
+        }
+
+        if (exiting)
+        {
+            break;
+        }
+
+        if ( ! wrote)
+        {
+            PIN_SemaphoreWait(&writer->work);
+        }
+    }
+
+    PIN_SemaphoreSet(&writer->drained);
+}
+
+void StartAsyncWriters(UINT32 count)
+{
+    PIN_MutexInit(&async_stats_lock);
+
+    for (UINT32 i = 0; i < count; i++)
+    {
+        AsyncWriter *writer = new AsyncWriter;
+
+        PIN_MutexInit(&writer->lock);
+        PIN_SemaphoreInit(&writer->work);
+        PIN_SemaphoreInit(&writer->drained);
+        writer->exiting = 0;
+
+        asyncWriters.push_back(writer);
+
+        if (PIN_SpawnInternalThread(AsyncWriterThread, writer, 0, &writer->uid) == INVALID_THREADID)
+        {
+            cerr << "Error: could not spawn writer thread." << endl;
+            PIN_ExitProcess(1);
+        }
+    }
+}
+
+// Internal threads have to be gone before Pin runs the Fini callbacks. Sinks
+// still open afterwards write on their own thread.
+VOID StopAsyncWriters(VOID *v)
+{
+    if (asyncWritersStopped)
+    {
+        return;
+    }
+
+    asyncWritersStopped = TRUE;
+
+    for (size_t i = 0; i < asyncWriters.size(); i++)
+    {
+        __atomic_store_n(&asyncWriters[i]->exiting, 1, __ATOMIC_SEQ_CST);
+        PIN_SemaphoreSet(&asyncWriters[i]->work);
+    }
+
+    for (size_t i = 0; i < asyncWriters.size(); i++)
+    {
+        PIN_WaitForThreadTermination(asyncWriters[i]->uid, PIN_INFINITE_TIMEOUT, NULL);
+    }
+}
+
+VOID WriteAsyncWriterStats()
+{
+    PIN_MutexLock(&async_stats_lock);
+
+    cout << "writer threads: " << asyncStreams << " streams, " << asyncBuffers << " buffers, ring full "
+         << asyncFullWaits << " times, " << asyncWaitNs / 1000000 << " ms waited, at most "
+         << asyncMaxQueued << " of " << KnobWriterRing.Value() << " buffers queued" << endl;
+
+    PIN_MutexUnlock(&async_stats_lock);
+}
+
+/* ===================================================================== */
+/* Sink selection                                                        */
+/* ===================================================================== */
+
+KNOB<string> KnobSink(KNOB_MODE_WRITEONCE, "pintool",
+    "sink", "fifo", "where the per-thread streams go: fifo, file, xz or zstd");
+
+KNOB<string> KnobOutputDir(KNOB_MODE_WRITEONCE, "pintool",
+    "out_dir", "", "put the streams of this run in <dir>/run_<pid>, named after the logical thread and OS tid");
+
+UINT32 sinkKind = SINK_FIFO;
+
+// empty unless -out_dir is given
+string runDirectory;
+
+UINT32 ParseSinkKind(const string &name)
+{
+    if (name == "fifo")
+    {
+        return SINK_FIFO;
+    }
+    if (name == "file")
+    {
+        return SINK_FILE;
+    }
+    if (name == "xz")
+    {
+#if defined(TRACER_WITH_LZMA)
+        return SINK_XZ;
+#else
+        cerr << "Error: -sink xz requires a tool built with WITH_LZMA=1" << endl;
+        PIN_ExitProcess(1);
+#endif
+    }
+    if (name == "zstd")
+    {
+#if defined(TRACER_WITH_ZSTD)
+        return SINK_ZSTD;
+#else
+        cerr << "Error: -sink zstd requires a tool built with WITH_ZSTD=1" << endl;
+        PIN_ExitProcess(1);
+#endif
+    }
+
+    cerr << "Error: unknown -sink value " << name << endl;
+    PIN_ExitProcess(1);
+    return SINK_FIFO;
+}
+
+const char* SinkSuffix(UINT32 kind)
+{
+    switch (kind)
+    {
+        case SINK_XZ:   return ".xz";
+        case SINK_ZSTD: return ".zst";
+        default:        return "";
+    }
+}
+
+// Name of stream "kind" of logical thread threadNum. Without -out_dir the
+// trace streams keep the names the scratch scripts expect.
+string StreamFileName(const string &kind, UINT64 threadNum, OS_THREAD_ID osTid)
+{
+    if ( ! runDirectory.empty())
+    {
+        return runDirectory + "/" + kind + "_" + decstr(threadNum) + "_" + decstr(osTid) + SinkSuffix(sinkKind);
+    }
+
+    if (kind == "trace")
+    {
+        switch (sinkKind)
+        {
+            case SINK_FIFO: return "named_pipe_" + decstr(threadNum);
+            case SINK_FILE: return "trace_" + decstr(threadNum);
+            default:        return "compressed_" + decstr(threadNum) + SinkSuffix(sinkKind);
+        }
+    }
+
+    return kind + "_" + decstr(threadNum) + SinkSuffix(sinkKind);
+}
+
+TraceSink* OpenSinkFile(const string &fileName, BOOL isFifo, size_t bufferBytes)
+{
+    if (isFifo)
+    {
+        struct stat st;
+        if (stat(fileName.c_str(), &st) != 0)
+        {
+            // no pre-made pipe for this thread, make one, a reader has to attach before the thread can go on
+            if (mkfifo(fileName.c_str(), 0644) != 0)
+            {
+                cerr << "Error: could not create FIFO " << fileName << endl;
+                PIN_ExitProcess(1);
+            }
+            cerr << "Created FIFO " << fileName << ", waiting for a reader" << endl;
+        }
+        else if ( ! S_ISFIFO(st.st_mode))
+        {
+            cerr << "Error: " << fileName << " exists and is not a FIFO" << endl;
+            PIN_ExitProcess(1);
+        }
+    }
+
+    FILE *file = fopen(fileName.c_str(), "wb");
+
+    if ( ! file )
+    {
+        cerr << "Error: could not open output file " << fileName << endl;
+        PIN_ExitProcess(1);
+    }
+
+    if ((sinkKind == SINK_XZ) || (sinkKind == SINK_ZSTD))
+    {
+        return new CompressedSink(file, sinkKind, bufferBytes);
+    }
+
+    // stdio buffering is redundant, records are already staged by the caller
+    setvbuf(file, NULL, _IONBF, 0);
+
+    if ( ! asyncWriters.empty())
+    {
+        return new AsyncSink(file, bufferBytes);
+    }
+
+    return new FileSink(file, bufferBytes);
+}
+
+TraceSink* OpenSink(const string &kind, UINT64 threadNum, OS_THREAD_ID osTid, size_t bufferBytes)
+{
+    // only the traces go to pipes, nobody reads the side streams from one
+    const BOOL isFifo = (sinkKind == SINK_FIFO) && (kind == "trace");
+
+    return OpenSinkFile(StreamFileName(kind, threadNum, osTid), isFifo, bufferBytes);
+}
+
+// Byte stream on top of a sink, for the side outputs that are not made of
+// trace records.
+class StreamWriter
+{
+  public:
+
+    StreamWriter(TraceSink *s) : sink(s), used(0)
+    {
+        buffer = sink->openBuffer();
+    }
+
+    void append(const void *data, size_t size);
+
+    void append(const string &text)
+    {
+        append(text.data(), text.size());
+    }
+
+    // close the sink, the writer is gone afterwards
+    void close();
+
+    TraceSink *sink;
+
+    UINT8 *buffer;
+
+    size_t used;
+};
+
+void StreamWriter::append(const void *data, size_t size)
+{
+    const UINT8 *bytes = static_cast<const UINT8*>(data);
+
+    while (size > 0)
+    {
+        size_t chunk = sink->bufferBytes - used;
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+
+        memcpy(buffer + used, bytes, chunk);
+        used += chunk;
+        bytes += chunk;
+        size -= chunk;
+
+        if (used == sink->bufferBytes)
+        {
+            buffer = sink->write(buffer, used);
+            used = 0;
+        }
+    }
+}
+
+void StreamWriter::close()
+{
+    sink->close(buffer, used);
+    delete this;
+}
+
+// default staging size of the side streams
+#define SIDE_STREAM_BUFFER (1 << 16)
+
+StreamWriter* OpenStreamWriter(const string &kind, UINT64 threadNum, OS_THREAD_ID osTid)
+{
+    return new StreamWriter(OpenSink(kind, threadNum, osTid, SIDE_STREAM_BUFFER));
+}
+
+// path of a per-run output file, next to the streams
+string RunFileName(const string &name)
+{
+    return runDirectory.empty() ? name : runDirectory + "/" + name;
+}
+
+void InitSinks()
+{
+    sinkKind = ParseSinkKind(KnobSink.Value());
+
+    if ( ! KnobOutputDir.Value().empty())
+    {
+        runDirectory = KnobOutputDir.Value() + "/run_" + decstr(PIN_GetPid());
+
+        mkdir(KnobOutputDir.Value().c_str(), 0755);
+
+        if ((mkdir(runDirectory.c_str(), 0755) != 0) && (errno != EEXIST))
+        {
+            cerr << "Error: could not create run directory " << runDirectory << endl;
+            PIN_ExitProcess(1);
+        }
+    }
+
+    if ((sinkKind == SINK_XZ) || (sinkKind == SINK_ZSTD))
+    {
+        StartCompressionWorkers(KnobCompressThreads.Value());
+
+        // Register StopCompressionWorkers to drain the workers before exit.
+        PIN_AddPrepareForFiniFunction(StopCompressionWorkers, NULL);
+    }
+    else if (KnobWriterThreads.Value() > 0)
+    {
+        StartAsyncWriters(KnobWriterThreads.Value());
+
+        PIN_AddPrepareForFiniFunction(StopAsyncWriters, NULL);
+    }
+}
+
+/* ===================================================================== */
+/* Trace segments                                                        */
+/* ===================================================================== */
+
+// With -segment_length every thread's trace is cut into files of that many
+// records. Each segment is a stream of its own (own xz/zstd stream, own
+// compression worker), named like the whole trace with the segment number
+// before the suffix. segments.jsonl maps every segment to its thread,
+// instruction range and byte offset in the thread's uncompressed trace, so a
+// window can be decoded without the segments before it. The instruction
+// numbers assume a thread's records are consecutive instructions, which
+// holds for all trace windows.
+
+KNOB<UINT64> KnobSegmentLength(KNOB_MODE_WRITEONCE, "pintool",
+    "segment_length", "0", "cut every thread's trace into files of this many instructions, 0 writes one file per thread");
+
+ofstream segmentIndex;
+
+PIN_MUTEX segmentIndexLock;
+
+string SegmentFileName(UINT64 threadNum, OS_THREAD_ID osTid, UINT32 segment)
+{
+    const string fileName = StreamFileName("trace", threadNum, osTid);
+    const string suffix = SinkSuffix(sinkKind);
+
+    char number[16];
+    snprintf(number, sizeof(number), ".%04u", segment);
+
+    return fileName.substr(0, fileName.size() - suffix.size()) + number + suffix;
+}
+
+void WriteSegmentIndex(UINT64 threadNum, UINT32 segment, const string &fileName,
+        UINT64 firstIns, UINT64 records, UINT64 recordOffset)
+{
+    // the index sits next to the segments
+    const size_t slash = fileName.rfind('/');
+
+    std::ostringstream line;
+    line << "{\"thread\":" << threadNum << ",\"segment\":" << segment
+         << ",\"file\":\"" << fileName.substr((slash == string::npos) ? 0 : slash + 1) << "\""
+         << ",\"first\":" << firstIns << ",\"last\":" << firstIns + records - 1
+         << ",\"records\":" << records
+         << ",\"offset\":" << recordOffset * sizeof(trace_instr_format_t) << "}\n";
+
+    PIN_MutexLock(&segmentIndexLock);
+    segmentIndex << line.str();
+    segmentIndex.flush();
+    PIN_MutexUnlock(&segmentIndexLock);
+}
+
+void InitSegments()
+{
+    if (KnobSegmentLength.Value() == 0)
+    {
+        return;
+    }
+
+    if (sinkKind == SINK_FIFO)
+    {
+        cerr << "Error: -segment_length needs -sink file, xz or zstd" << endl;
+        PIN_ExitProcess(1);
+    }
+
+    PIN_MutexInit(&segmentIndexLock);
+
+    const string indexFileName = RunFileName("segments.jsonl");
+    segmentIndex.open(indexFileName.c_str());
+}
+
+/*
+ * MLOG - thread specific data that is not handled by the buffering API.
+ */
+class MLOG
+{
+  public:
+
+    TraceSink *traceSink;
+
+    // logical thread number, unlike Pin thread IDs these are never reused
+    UINT64 threadNum;
+
+    OS_THREAD_ID osTid;
+
+    trace_instr_format_t trace;
+
+    // staging buffer, records are written out in batches of traceBufferSize
+    trace_instr_format_t *traceBuffer;
+
+    UINT32 traceBufferCount;
+
+    UINT32 traceBufferSize;
+
+    // instruction number of the first record in traceBuffer
+    UINT64 bufferFirstIns;
+
+    // -segment_length: the open segment, the records already written to it,
+    // and the records of the segments before it
+    UINT32 segmentNumber;
+
+    UINT64 segmentRecords;
+
+    UINT64 segmentOffset;
+
+    string segmentFile;
+
+    UINT64 ip;
+
+    UINT64 insNum;
+
+    // only instructions with traceStart < insNum <= traceEnd are written out
+    UINT64 traceStart;
+
+    UINT64 traceEnd;
+
+    // instructions counted since the last fast-forward/window checkpoint
+    UINT64 pendingCount;
+
+    // -mode bbv: instructions per block id in the current interval, and the
+    // ids touched in it so the interval can be written without a full scan
+    vector<UINT64> bbvCounts;
+
+    vector<UINT32> bbvTouched;
+
+    UINT64 bbvIntervalIns;
+
+    UINT64 bbvIntervals;
+
+    StreamWriter *bbvWriter;
+
+    // -sync: synchronization events of this thread
+    StreamWriter *syncWriter;
+
+    // nesting of instrumented sync calls, only the outermost one is recorded
+    UINT32 syncDepth;
+
+    // pthread_t* of the pthread_create in progress
+    ADDRINT syncCreateHolder;
+
+    // futex uaddr and op while in the syscall
+    ADDRINT syncFutexAddr;
+
+    ADDRINT syncFutexOp;
+
+    // -mode cachefilter: private caches, and the instruction number of the last miss record
+    CacheModel *l1d;
+
+    CacheModel *l2;
+
+    UINT64 lastMissIns;
+
+    // this thread's accesses to the shared LLC, whose own counters are not
+    // kept under one lock
+    UINT64 llcHits;
+
+    UINT64 llcMisses;
+
+    StreamWriter *missWriter;
+
+    // -mode profile: this thread's counters, also read by the sampler thread
+    thread_data_t *profile;
+
+    // -mode pages: this thread's page counts, and the 4K page it accessed last
+    pages_thread_t *pages;
+
+    ADDRINT pageLast;
+
+    page_count_t *pageLastCount;
+
+    // -clock: the instruction number after which the next interval marker
+    // is due, and the markers written so far
+    UINT64 clockNextIns;
+
+    UINT64 clockMarkers;
+
+    // logical thread number of the parent
+    UINT64 parentThreadID;
+
+    MLOG *parentMlog;
+
+    ThreadDependencyNode* threadDependencyNode;
+
+    ThreadDependencyNode* threadDependencyTail;
+
+    PIN_MUTEX threadLockMutex;    
+
+    child_thread_record_node *child_thread_record_root_node;
+
+    child_thread_record_node *child_thread_record_tail_node;
+
+    // first node whose thread has not been matched by updateChildTHreadRecordNode
+    child_thread_record_node *child_thread_record_pending_node;
+
+    UINT8 _pad[PAD_SIZE];
+
+    void insertChildThreadRecordNode(
+        UINT64 parent_thread_pthread_create_ins_num,        
+        UINT32 parent_thread_ID
+    );
+
+    void updateChildTHreadRecordNode(
+        UINT64 parent_thread_thread_start_ins_num,
+        UINT32 pin_assigned_thread_ID,
+        ADDRINT pthread_t_value
+    );
+
+    void insertSpaceInThreadCreation();
+
+    void popSpaceInThreadCreation(UINT64 parent, UINT64 child);
+
+    void flushTraceBuffer();
+
+    void splitSegments();
+
+    void closeSegment(UINT32 count);
+
+    void closeTrace();
+};
+
+// Close the first count records of traceBuffer together with the open
+// segment. Hands traceBuffer over to the segment's sink.
+void MLOG::closeSegment(UINT32 count)
+{
+    const UINT64 records = segmentRecords + count;
+
+    traceSink->close(reinterpret_cast<UINT8*>(traceBuffer), count * sizeof(trace_instr_format_t));
+
+    if (records > 0)
+    {
+        WriteSegmentIndex(threadNum, segmentNumber, segmentFile, bufferFirstIns - segmentRecords, records, segmentOffset);
+    }
+    else
+    {
+        // nothing traced in the window, or opened at the end of the previous
+        // segment and the thread did not get further; not in the index either
+        unlink(segmentFile.c_str());
+    }
+
+    segmentOffset += records;
+    segmentRecords = 0;
+    segmentNumber++;
+}
+
+// End the open segment as often as the records in traceBuffer reach its end,
+// moving what is left into the staging buffer of the next segment.
+void MLOG::splitSegments()
+{
+    const UINT64 length = KnobSegmentLength.Value();
+
+    while (segmentRecords + traceBufferCount >= length)
+    {
+        const UINT32 head = (UINT32)(length - segmentRecords);
+        const UINT32 tail = traceBufferCount - head;
+
+        // the old buffer belongs to the old sink once it is closed
+        const string nextFile = SegmentFileName(threadNum, osTid, segmentNumber + 1);
+        TraceSink *nextSink = OpenSinkFile(nextFile, FALSE, traceBufferSize * sizeof(trace_instr_format_t));
+        trace_instr_format_t *nextBuffer = reinterpret_cast<trace_instr_format_t*>(nextSink->openBuffer());
+
+        memcpy(nextBuffer, traceBuffer + head, tail * sizeof(trace_instr_format_t));
+
+        closeSegment(head);
+
+        traceSink = nextSink;
+        traceBuffer = nextBuffer;
+        traceBufferCount = tail;
+        bufferFirstIns += head;
+        segmentFile = nextFile;
+    }
+}
+
+void MLOG::closeTrace()
+{
+    if (KnobSegmentLength.Value() > 0)
+    {
+        splitSegments();
+        closeSegment(traceBufferCount);
+    }
+    else
+    {
+        traceSink->close(reinterpret_cast<UINT8*>(traceBuffer), traceBufferCount * sizeof(trace_instr_format_t));
+    }
+
+    traceSink = NULL;
+    traceBuffer = NULL;
+}
+
+void MLOG::flushTraceBuffer()
+{
+    if (traceBufferCount == 0)
+    {
+        return;
+    }
+
+    if (KnobSegmentLength.Value() > 0)
+    {
+        splitSegments();
+
+        // the records left over wait in the next segment's buffer
+        if (traceBufferCount < traceBufferSize)
+        {
+            return;
+        }
+
+        segmentRecords += traceBufferCount;
+    }
+
+    UINT8 *next = traceSink->write(reinterpret_cast<UINT8*>(traceBuffer), traceBufferCount * sizeof(trace_instr_format_t));
+
+    traceBuffer = reinterpret_cast<trace_instr_format_t*>(next);
+    bufferFirstIns += traceBufferCount;
+    traceBufferCount = 0;
+}
+
+void MLOG::insertChildThreadRecordNode(
+    UINT64 parent_thread_pthread_create_ins_num,
+    UINT32 parent_thread_ID
+    )
+{   
+    child_thread_record_node* node = new child_thread_record_node;
+    node->parent_thread_pthread_create_ins = parent_thread_pthread_create_ins_num;        
+    node->pin_assigned_parent_thread_ID = parent_thread_ID;
+    node->pthread_t_value = 0;
+    node->next = NULL;
+
+    PIN_MutexLock(&threadLockMutex);
+
+    if (child_thread_record_root_node == NULL)
+    {
+        child_thread_record_root_node = node;
+    }
+    else
+    {
+        child_thread_record_tail_node->next = node;
+    }    
+    child_thread_record_tail_node = node;
+
+    if (child_thread_record_pending_node == NULL)
+    {
+        child_thread_record_pending_node = node;
+    }
+
+    PIN_MutexUnlock(&threadLockMutex);
+}
+
+void MLOG::updateChildTHreadRecordNode(
+        UINT64 parent_thread_thread_start_ins_num,
+        UINT32 assigned_thread_ID,
+        ADDRINT pthread_t_value
+    )
+{
+    PIN_MutexLock(&threadLockMutex);
+
+    // children usually start in creation order, so the match is normally the
+    // first pending node and the scan stops right away
+    child_thread_record_node* tmpp = child_thread_record_pending_node;
+
+    while ((tmpp != NULL) && (tmpp->pthread_t_value != 0) && (tmpp->pthread_t_value != pthread_t_value))
+    {
+        tmpp = tmpp->next;
+    }
+
+    if (tmpp != NULL)
+    {
+        tmpp->parent_thread_thread_start_ins = parent_thread_thread_start_ins_num;
+        tmpp->pin_assigned_thread_ID = assigned_thread_ID;        
+
+        if (tmpp == child_thread_record_pending_node)
+        {
+            child_thread_record_pending_node = tmpp->next;
+        }
+    }
+
+    PIN_MutexUnlock(&threadLockMutex);
+}
+
+void MLOG::insertSpaceInThreadCreation()
+{
+    ThreadDependencyNode* node = new ThreadDependencyNode;
+    node->threadPINID = 0;
+    node->instructionNumber = insNum;
+    node->next = NULL;
+
+    PIN_MutexLock(&threadLockMutex);
+    if (threadDependencyNode == NULL)
+    {
+        threadDependencyNode = node;
+    }
+    else
+    {
+        threadDependencyTail->next = node;
+    }
+    threadDependencyTail = node;
+    PIN_MutexUnlock(&threadLockMutex);
+}
+
+void MLOG::popSpaceInThreadCreation(UINT64 parent, UINT64 child)
+{
+    // PIN_MutexLock(&threadLockMutex);    
+    // // ThreadDependencyNode* tmpp = threadDependencyNode;
+    // // cout << "there 5" << endl;
+    // // threadDependencyNode = threadDependencyNode->next;    
+    // // // threadDependency << "Thread " 
+    // // // << setw(5) << child 
+    // // // << " started by thread " << setw(5) << parent << " with pthread_create"
+    // // // << " at instruction " << setw(12) << dec << tmpp->instructionNumber 
+    // // // << ", actually started at instruction " << setw(12) << insNum
+    // // // << endl;
+
+    // // delete tmpp;
+
+    // PIN_MutexUnlock(&threadLockMutex);
+
+    insertThreadDependencyDB(child, parent, insNum);
+}
+
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
+    "o", "", "specify dependency record file name");
+
+KNOB<UINT32> KnobTraceBufferSize(KNOB_MODE_WRITEONCE, "pintool",
+    "trace_buffer", "16384", "number of trace records buffered per thread before they are written out");
+
+KNOB<UINT64> KnobSkip(KNOB_MODE_WRITEONCE, "pintool",
+    "skip", "0", "number of instructions to fast-forward before tracing starts");
+
+KNOB<UINT64> KnobTraceLength(KNOB_MODE_WRITEONCE, "pintool",
+    "trace_length", "0", "number of instructions to trace after the fast-forward, 0 traces until the end");
+
+KNOB<BOOL> KnobSkipPerThread(KNOB_MODE_WRITEONCE, "pintool",
+    "skip_per_thread", "0", "apply -skip and -trace_length to every thread separately instead of to all threads together");
+
+KNOB<BOOL> KnobDetach(KNOB_MODE_WRITEONCE, "pintool",
+    "detach", "1", "detach from the application once the -trace_length window or the -roi region is done");
+
+KNOB<BOOL> KnobRoi(KNOB_MODE_WRITEONCE, "pintool",
+    "roi", "0", "trace only between the ROI markers of mt_program/roi.h (tracer_roi_begin/tracer_roi_end calls or Sniper magic instructions)");
+
+KNOB<BOOL> KnobPrecompute(KNOB_MODE_WRITEONCE, "pintool",
+    "precompute", "1", "build the static part of each record at instrumentation time and trace with one analysis call per instruction");
+
+KNOB<string> KnobDependencyFormat(KNOB_MODE_WRITEONCE, "pintool",
+    "dep_format", "jsonl", "format of the -o dependency record: jsonl (written as threads start and finish) or text (table at exit)");
+
+ofstream threadDependency;
+
+// -dep_format jsonl, one JSON object per line, see tools/dependency_reader.h
+BOOL dependencyJsonl = TRUE;
+
+PIN_MUTEX dependency_lock;
+
+UINT64 nextThreadNum = 0;
+
+// Lines are flushed right away so a crashed or killed run keeps them.
+void WriteDependencyLine(const string &line)
+{
+    PIN_MutexLock(&dependency_lock);
+    threadDependency << line << std::endl;
+    PIN_MutexUnlock(&dependency_lock);
+}
+
+// Force each thread's data to be in its own data cache line so that
+// multiple threads do not contend for the same data cache line.
+// This avoids the false sharing problem.
+#define PADSIZE 40  // 64 byte line size: 64-24
+
+// running counts of the instructions, memory operands and branches of a
+// thread, for -mode profile
+class thread_data_t
+{
+  public:
+    thread_data_t() : _count(0), _memOps(0), _branches(0) {}
+    UINT64 _count;
+    UINT64 _memOps;
+    UINT64 _branches;
+    UINT8 _pad[PADSIZE];
+};
+
+// clock markers, see "Clock markers" below
+VOID EmitClockMarker(MLOG *mlog, UINT32 reason);
+VOID ClockMarkerAt(MLOG *mlog, UINT32 reason);
+
+void BeginInstruction(VOID *ip, UINT32 op_code, MLOG* mlog)
+{                  
+    mlog->insNum += 1;
+    mlog->ip = (unsigned long long int)ip;
+
+    // reset the current instruction
+    BeginRecord(&mlog->trace, (unsigned long long int)ip);
+}
+
+void EndInstruction(MLOG* mlog)
+{             
+    if ((mlog->insNum <= mlog->traceStart) || (mlog->insNum > mlog->traceEnd))
+    {
+        return;
+    }
+
+    if (mlog->traceBufferCount == 0)
+    {
+        mlog->bufferFirstIns = mlog->insNum;
+    }
+
+    mlog->traceBuffer[mlog->traceBufferCount++] = mlog->trace;
+
+    if (mlog->traceBufferCount == mlog->traceBufferSize)
+    {
+        mlog->flushTraceBuffer();
+    }
+
+    if (mlog->insNum >= mlog->clockNextIns)
+    {
+        EmitClockMarker(mlog, CLOCK_AT_INTERVAL);
+    }
+}
+
+void BranchOrNot(UINT32 taken, MLOG* mlog)
+{       
+    mlog->trace.is_branch = 1;
+
+    if(taken != 0)
+    {
+        mlog->trace.branch_taken = 1;        
+    }
+}
+
+void RegRead(UINT32 i, UINT32 index, MLOG* mlog)
+{          
+    InsertSourceRegister(&mlog->trace, (unsigned char)i);
+}
+
+void RegWrite(REG i, UINT32 index, MLOG* mlog)
+{          
+    InsertDestinationRegister(&mlog->trace, (unsigned char)i);
+}
+
+void MemoryRead(VOID* addr, UINT32 index, UINT32 read_size, MLOG* mlog)
+{         
+    InsertSourceMemory(&mlog->trace, (unsigned long long int)addr);
+}
+
+void MemoryWrite(VOID* addr, UINT32 index, MLOG* mlog)
+{               
+    InsertDestinationMemory(&mlog->trace, (unsigned long long int)addr);
+}
+
+// Whole record in one call: copy the instruction's template into the staging
+// buffer and add what is only known at run time.
+void RecordInstruction(const instr_template_t *tmpl, UINT32 taken, ADDRINT ea0, ADDRINT ea1, MLOG* mlog)
+{
+    mlog->insNum += 1;
+    mlog->ip = tmpl->record.ip;
+
+    if ((mlog->insNum <= mlog->traceStart) || (mlog->insNum > mlog->traceEnd))
+    {
+        return;
+    }
+
+    if (mlog->traceBufferCount == 0)
+    {
+        mlog->bufferFirstIns = mlog->insNum;
+    }
+
+    const uint64_t ea[MAX_TEMPLATE_MEMOPS] = { ea0, ea1 };
+
+    EncodeFromTemplate(&mlog->traceBuffer[mlog->traceBufferCount], tmpl, taken, ea);
+
+    if (++mlog->traceBufferCount == mlog->traceBufferSize)
+    {
+        mlog->flushTraceBuffer();
+    }
+
+    if (mlog->insNum >= mlog->clockNextIns)
+    {
+        EmitClockMarker(mlog, CLOCK_AT_INTERVAL);
+    }
+}
+
+// Instrument ins with a single RecordInstruction call. Returns FALSE if the
+// instruction has too many memory operands for a template.
+BOOL InstructionPrecomputed(INS ins)
+{
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+    if (memOperands > MAX_TEMPLATE_MEMOPS)
+    {
+        return FALSE;
+    }
+
+    instr_template_t *tmpl = new instr_template_t;
+
+    BeginTemplate(tmpl, INS_Address(ins), INS_IsBranch(ins));
+
+    UINT32 readRegCount = INS_MaxNumRRegs(ins);
+    for(UINT32 i=0; i<readRegCount; i++)
+    {
+        InsertSourceRegister(&tmpl->record, (unsigned char)INS_RegR(ins, i));
+    }
+
+    UINT32 writeRegCount = INS_MaxNumWRegs(ins);
+    for(UINT32 i=0; i<writeRegCount; i++)
+    {
+        InsertDestinationRegister(&tmpl->record, (unsigned char)INS_RegW(ins, i));
+    }
+
+    // effective addresses of the operands, absent ones are passed as 0
+    IARGLIST eaArgs = IARGLIST_Alloc();
+
+    for (UINT32 memOp = 0; memOp < MAX_TEMPLATE_MEMOPS; memOp++)
+    {
+        if (memOp < memOperands)
+        {
+            tmpl->memOpFlags[memOp] = (INS_MemoryOperandIsRead(ins, memOp) ? MEMOP_READ : 0)
+                                    | (INS_MemoryOperandIsWritten(ins, memOp) ? MEMOP_WRITE : 0);
+
+            IARGLIST_AddArguments(eaArgs, IARG_MEMORYOP_EA, memOp, IARG_END);
+        }
+        else
+        {
+            IARGLIST_AddArguments(eaArgs, IARG_ADDRINT, (ADDRINT)0, IARG_END);
+        }
+    }
+
+    if (tmpl->record.is_branch)
+    {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordInstruction,
+                IARG_PTR, tmpl, IARG_BRANCH_TAKEN, IARG_IARGLIST, eaArgs, IARG_REG_VALUE, mlog_reg,
+                IARG_END);
+    }
+    else
+    {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordInstruction,
+                IARG_PTR, tmpl, IARG_UINT32, 0, IARG_IARGLIST, eaArgs, IARG_REG_VALUE, mlog_reg,
+                IARG_END);
+    }
+
+    IARGLIST_Free(eaArgs);
+
+    return TRUE;
+}
+
+void Instruction(INS ins, VOID *v)
+{
+    if (KnobPrecompute.Value() && InstructionPrecomputed(ins))
+    {
+        return;
+    }
+
+    // begin each instruction with this function
+    UINT32 opcode = INS_Opcode(ins);
+    
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)BeginInstruction, IARG_INST_PTR, IARG_UINT32, opcode, IARG_REG_VALUE, mlog_reg, IARG_END);
+
     
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)BeginInstruction, IARG_INST_PTR, IARG_UINT32, opcode, IARG_THREAD_ID, IARG_END);
+    // instrument branch instructions
+    if(INS_IsBranch(ins))
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)BranchOrNot, IARG_BRANCH_TAKEN, IARG_REG_VALUE, mlog_reg, IARG_END);
+
+    // instrument register reads
+    UINT32 readRegCount = INS_MaxNumRRegs(ins);
+    for(UINT32 i=0; i<readRegCount; i++) 
+    {
+        UINT32 regNum = INS_RegR(ins, i);
+
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RegRead,
+                IARG_UINT32, regNum, IARG_UINT32, i, IARG_REG_VALUE, mlog_reg, 
+                IARG_END);
+    }
+
+    // instrument register writes
+    UINT32 writeRegCount = INS_MaxNumWRegs(ins);
+    for(UINT32 i=0; i<writeRegCount; i++) 
+    {
+        UINT32 regNum = INS_RegW(ins, i);
+
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RegWrite,
+                IARG_UINT32, regNum, IARG_UINT32, i, IARG_REG_VALUE, mlog_reg,
+                IARG_END);
+    }
+
+    // instrument memory reads and writes
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+    // Iterate over each memory operand of the instruction.
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++) 
+    {
+        if (INS_MemoryOperandIsRead(ins, memOp)) 
+        {
+            UINT32 read_size = INS_MemoryOperandSize(ins, memOp);
+
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryRead,
+                    IARG_MEMORYOP_EA, memOp, IARG_UINT32, memOp, IARG_UINT32, read_size, IARG_REG_VALUE, mlog_reg,
+                    IARG_END);
+        }
+        if (INS_MemoryOperandIsWritten(ins, memOp)) 
+        {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryWrite,
+                    IARG_MEMORYOP_EA, memOp, IARG_UINT32, memOp, IARG_REG_VALUE, mlog_reg,
+                    IARG_END);
+        }
+    }    
+
+    // finalize each instruction with this function
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)EndInstruction, IARG_REG_VALUE, mlog_reg, IARG_END);
+}
+
+/* ===================================================================== */
+/* Basic block vectors                                                   */
+/* ===================================================================== */
+
+// -mode bbv writes one SimPoint frequency vector per thread and interval,
+// "T:<block id>:<instructions> :<block id>:<instructions> ...", instead of
+// the trace. Block ids start at 1 and are shared by all threads.
+
+#define MODE_TRACE        0
+#define MODE_BBV          1
+#define MODE_SHARING      2
+#define MODE_CACHE_FILTER 3
+#define MODE_PROFILE      4
+#define MODE_PAGES        5
+
+KNOB<string> KnobMode(KNOB_MODE_WRITEONCE, "pintool",
+    "mode", "trace", "what the tool records: trace, bbv, sharing, cachefilter, profile or pages");
+
+KNOB<UINT64> KnobBbvInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "bbv_interval", "100000000", "instructions per basic block vector interval of a thread");
+
+UINT32 toolMode = MODE_TRACE;
+
+struct bbv_block_t
+{
+    UINT32 id;
+    UINT32 numIns;
+};
+
+// a block keeps its id when it is instrumented again, e.g. in another trace
+map<pair<ADDRINT, UINT32>, bbv_block_t*> bbvBlocks;
+
+PIN_LOCK bbv_lock;
+
+ofstream bbvThreads;
+
+UINT32 ParseToolMode(const string &name)
+{
+    if (name == "trace")
+    {
+        return MODE_TRACE;
+    }
+    if (name == "bbv")
+    {
+        return MODE_BBV;
+    }
+    if (name == "sharing")
+    {
+        return MODE_SHARING;
+    }
+    if (name == "cachefilter")
+    {
+        return MODE_CACHE_FILTER;
+    }
+    if (name == "profile")
+    {
+        return MODE_PROFILE;
+    }
+    if (name == "pages")
+    {
+        return MODE_PAGES;
+    }
+
+    cerr << "Error: unknown -mode value " << name << endl;
+    PIN_ExitProcess(1);
+    return MODE_TRACE;
+}
+
+VOID EmitBbvInterval(MLOG *mlog)
+{
+    if (mlog->bbvTouched.empty())
+    {
+        return;
+    }
+
+    std::ostringstream line;
+    line << "T";
+
+    for (size_t i = 0; i < mlog->bbvTouched.size(); i++)
+    {
+        UINT32 id = mlog->bbvTouched[i];
+
+        line << ":" << id << ":" << mlog->bbvCounts[id] << " ";
+        mlog->bbvCounts[id] = 0;
+    }
+
+    line << "\n";
+
+    mlog->bbvWriter->append(line.str());
+
+    mlog->bbvTouched.clear();
+    mlog->bbvIntervalIns = 0;
+    mlog->bbvIntervals++;
+}
+
+VOID BbvCountBlock(const bbv_block_t *block, MLOG* mlog)
+{
+    mlog->insNum += block->numIns;
+
+    if ((mlog->insNum <= mlog->traceStart) || (mlog->insNum > mlog->traceEnd))
+    {
+        return;
+    }
+
+    if (block->id >= mlog->bbvCounts.size())
+    {
+        mlog->bbvCounts.resize(2 * block->id + 1, 0);
+    }
+
+    if (mlog->bbvCounts[block->id] == 0)
+    {
+        mlog->bbvTouched.push_back(block->id);
+    }
+
+    mlog->bbvCounts[block->id] += block->numIns;
+    mlog->bbvIntervalIns += block->numIns;
+
+    if (mlog->bbvIntervalIns >= KnobBbvInterval.Value())
+    {
+        EmitBbvInterval(mlog);
+    }
+}
+
+VOID InstrumentBbv(BBL bbl)
+{
+    pair<ADDRINT, UINT32> key(BBL_Address(bbl), BBL_NumIns(bbl));
+
+    PIN_GetLock(&bbv_lock, 1);
+
+    bbv_block_t *block = bbvBlocks[key];
+
+    if (block == NULL)
+    {
+        // operator[] already added the key, so ids start at 1
+        block = new bbv_block_t;
+        block->id = bbvBlocks.size();
+        block->numIns = key.second;
+        bbvBlocks[key] = block;
+    }
+
+    PIN_ReleaseLock(&bbv_lock);
+
+    BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)BbvCountBlock,
+            IARG_PTR, block, IARG_REG_VALUE, mlog_reg, IARG_END);
+}
+
+// last partial interval plus the per-thread instruction count
+VOID FinishBbv(MLOG *mlog, THREADID tid)
+{
+    EmitBbvInterval(mlog);
+
+    mlog->bbvWriter->close();
+    mlog->bbvWriter = NULL;
+
+    PIN_GetLock(&bbv_lock, tid + 1);
+
+    bbvThreads << "thread " << mlog->threadNum
+               << " pin_tid " << tid
+               << " os_tid " << mlog->osTid
+               << " instructions " << mlog->insNum
+               << " intervals " << mlog->bbvIntervals << endl;
+
+    PIN_ReleaseLock(&bbv_lock);
+}
+
+/* ===================================================================== */
+/* Synchronization events                                                */
+/* ===================================================================== */
+
+// -sync writes a side stream sync_<n> per thread with a sync_event_t for
+// every pthread call and futex syscall, tagged with the thread's instruction
+// number, so a simulator can replay the interleaving of the threads. The same
+// calls place clock markers in the traces with -clock_at_sync.
+
+#define SYNC_THREAD_START    1  // object: parent logical thread, arg: parent's instruction number
+#define SYNC_THREAD_EXIT     2
+#define SYNC_THREAD_CREATE   3  // object: pthread_t*, arg on exit: new pthread_t
+#define SYNC_THREAD_JOIN     4  // object: pthread_t
+#define SYNC_MUTEX_LOCK      5  // object: mutex
+#define SYNC_MUTEX_TRYLOCK   6  // object: mutex, arg on exit: return value
+#define SYNC_MUTEX_UNLOCK    7  // object: mutex
+#define SYNC_COND_WAIT       8  // object: condition variable, arg: mutex
+#define SYNC_COND_TIMEDWAIT  9  // object: condition variable, arg: mutex
+#define SYNC_COND_SIGNAL    10  // object: condition variable
+#define SYNC_COND_BROADCAST 11  // object: condition variable
+#define SYNC_BARRIER_WAIT   12  // object: barrier
+#define SYNC_FUTEX          13  // object: futex word, arg: futex op
+
+#define SYNC_ENTER 0
+#define SYNC_EXIT  1
+
+typedef struct sync_event
+{
+    unsigned long long int insNum;  // instruction number of the thread
+    unsigned long long int object;  // address of the synchronization object
+    unsigned long long int arg;
+    unsigned short type;            // SYNC_*
+    unsigned short phase;           // SYNC_ENTER or SYNC_EXIT
+    unsigned int threadNum;         // logical thread number
+} sync_event_t;
+
+struct sync_routine_t
+{
+    const char *name;
+    UINT16 type;
+    UINT32 numArgs;     // function arguments recorded, object then arg
+    BOOL recordExit;
+};
+
+static const sync_routine_t syncRoutines[] =
+{
+    { "pthread_create",         SYNC_THREAD_CREATE,  1, TRUE  },
+    { "pthread_join",           SYNC_THREAD_JOIN,    1, TRUE  },
+    { "pthread_mutex_lock",     SYNC_MUTEX_LOCK,     1, TRUE  },
+    { "pthread_mutex_trylock",  SYNC_MUTEX_TRYLOCK,  1, TRUE  },
+    { "pthread_mutex_unlock",   SYNC_MUTEX_UNLOCK,   1, FALSE },
+    { "pthread_cond_wait",      SYNC_COND_WAIT,      2, TRUE  },
+    { "pthread_cond_timedwait", SYNC_COND_TIMEDWAIT, 2, TRUE  },
+    { "pthread_cond_signal",    SYNC_COND_SIGNAL,    1, FALSE },
+    { "pthread_cond_broadcast", SYNC_COND_BROADCAST, 1, FALSE },
+    { "pthread_barrier_wait",   SYNC_BARRIER_WAIT,   1, TRUE  },
+};
+
+KNOB<BOOL> KnobSync(KNOB_MODE_WRITEONCE, "pintool",
+    "sync", "0", "write the synchronization events of each thread to sync_<n>");
+
+VOID WriteSyncEvent(MLOG *mlog, UINT16 type, UINT16 phase, ADDRINT object, ADDRINT arg)
+{
+    sync_event_t event;
+
+    event.insNum = mlog->insNum;
+    event.object = object;
+    event.arg = arg;
+    event.type = type;
+    event.phase = phase;
+    event.threadNum = (unsigned int)mlog->threadNum;
+
+    mlog->syncWriter->append(&event, sizeof(event));
+}
+
+VOID SyncEnter(UINT32 type, ADDRINT object, ADDRINT arg, MLOG* mlog)
+{
+    // e.g. a forwarder in libc calling into libpthread
+    if (mlog->syncDepth++ > 0)
+    {
+        return;
+    }
+
+    if (type == SYNC_THREAD_CREATE)
+    {
+        mlog->syncCreateHolder = object;
+    }
+
+    if (mlog->syncWriter != NULL)
+    {
+        WriteSyncEvent(mlog, type, SYNC_ENTER, object, arg);
+    }
+
+    ClockMarkerAt(mlog, CLOCK_AT_SYNC);
+}
+
+VOID SyncExit(UINT32 type, BOOL recordExit, ADDRINT ret, MLOG* mlog)
+{
+    if ((mlog->syncDepth == 0) || (--mlog->syncDepth > 0) || ! recordExit)
+    {
+        return;
+    }
+
+    ADDRINT arg = 0;
+
+    if (type == SYNC_THREAD_CREATE)
+    {
+        PIN_SafeCopy(&arg, (VOID*)mlog->syncCreateHolder, sizeof(arg));
+    }
+    else if (type == SYNC_MUTEX_TRYLOCK)
+    {
+        arg = ret;
+    }
+
+    if (mlog->syncWriter != NULL)
+    {
+        WriteSyncEvent(mlog, type, SYNC_EXIT, 0, arg);
+    }
+
+    ClockMarkerAt(mlog, CLOCK_AT_SYNC);
+}
+
+VOID InstrumentSyncRoutines(IMG img, VOID *v)
+{
+    for (size_t i = 0; i < sizeof(syncRoutines) / sizeof(syncRoutines[0]); i++)
+    {
+        const sync_routine_t &routine = syncRoutines[i];
+
+        RTN rtn = RTN_FindByName(img, routine.name);
+
+        if ( ! RTN_Valid(rtn))
+        {
+            continue;
+        }
+
+        RTN_Open(rtn);
+
+        if (routine.numArgs == 2)
+        {
+            RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)SyncEnter,
+                    IARG_UINT32, routine.type,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+                    IARG_REG_VALUE, mlog_reg, IARG_END);
+        }
+        else
+        {
+            RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)SyncEnter,
+                    IARG_UINT32, routine.type,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_ADDRINT, (ADDRINT)0,
+                    IARG_REG_VALUE, mlog_reg, IARG_END);
+        }
+
+        // the exit is needed for the nesting count even when not recorded
+        RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)SyncExit,
+                IARG_UINT32, routine.type, IARG_BOOL, routine.recordExit,
+                IARG_FUNCRET_EXITPOINT_VALUE, IARG_REG_VALUE, mlog_reg, IARG_END);
+
+        RTN_Close(rtn);
+    }
+}
+
+VOID SyncSyscallEntry(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v)
+{
+    if (PIN_GetSyscallNumber(ctxt, std) != SYS_futex)
+    {
+        return;
+    }
+
+    MLOG * mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, tid));
+
+    mlog->syncFutexAddr = PIN_GetSyscallArgument(ctxt, std, 0);
+    mlog->syncFutexOp = PIN_GetSyscallArgument(ctxt, std, 1);
+
+    if (mlog->syncWriter != NULL)
+    {
+        WriteSyncEvent(mlog, SYNC_FUTEX, SYNC_ENTER, mlog->syncFutexAddr, mlog->syncFutexOp);
+    }
+
+    ClockMarkerAt(mlog, CLOCK_AT_SYNC);
+}
+
+VOID SyncSyscallExit(THREADID tid, CONTEXT *ctxt, SYSCALL_STANDARD std, VOID *v)
+{
+    MLOG * mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, tid));
+
+    if (mlog->syncFutexAddr == 0)
+    {
+        return;
+    }
+
+    if (mlog->syncWriter != NULL)
+    {
+        WriteSyncEvent(mlog, SYNC_FUTEX, SYNC_EXIT, mlog->syncFutexAddr, mlog->syncFutexOp);
+    }
+
+    ClockMarkerAt(mlog, CLOCK_AT_SYNC);
+
+    mlog->syncFutexAddr = 0;
+}
+
+VOID StartSyncStream(MLOG *mlog, UINT64 parentThreadNum, UINT64 parentInsNum)
+{
+    mlog->syncWriter = OpenStreamWriter("sync", mlog->threadNum, mlog->osTid);
+
+    WriteSyncEvent(mlog, SYNC_THREAD_START, SYNC_ENTER, parentThreadNum, parentInsNum);
+}
+
+VOID FinishSyncStream(MLOG *mlog)
+{
+    WriteSyncEvent(mlog, SYNC_THREAD_EXIT, SYNC_ENTER, 0, 0);
+
+    mlog->syncWriter->close();
+    mlog->syncWriter = NULL;
+}
+
+/* ===================================================================== */
+/* Cache line sharing                                                    */
+/* ===================================================================== */
+
+// -mode sharing keeps shadow state for every 64-byte line the threads touch
+// instead of writing a trace. A write to a line that other threads hold (read
+// or written since the last write by another thread) invalidates their
+// copies. It is true sharing if the written bytes overlap the bytes the other
+// threads accessed, false sharing otherwise. At exit the lines with the most
+// invalidations are written to sharing.txt with the PCs involved.
+//
+// The shadow state is split into SHARING_SHARDS hash tables, each with its
+// own lock, so threads working on different lines rarely contend.
+
+#define SHARING_LINE_SHIFT 6
+
+#define SHARING_SHARDS 256
+
+// threads tracked per line, more holders are merged into the last slot
+#define SHARING_HOLDERS 4
+
+// PCs remembered per line
+#define SHARING_PCS 4
+
+#define SHARING_MERGED_HOLDER (~0U)
+
+KNOB<UINT32> KnobSharingTop(KNOB_MODE_WRITEONCE, "pintool",
+    "sharing_top", "50", "-mode sharing: number of lines written to sharing.txt");
+
+struct sharing_holder_t
+{
+    UINT32 threadNum;
+
+    // bytes of the line the holder accessed
+    UINT64 bytes;
+
+    // last PC of the holder on the line
+    ADDRINT pc;
+};
+
+struct sharing_pc_t
+{
+    ADDRINT pc;
+    UINT64 count;
+};
+
+struct sharing_line_t
+{
+    sharing_holder_t holders[SHARING_HOLDERS];
+
+    UINT32 holderCount;
+
+    // logical thread numbers below 64 of all threads that touched the line,
+    // and whether any higher one did
+    UINT64 threadMask;
+
+    BOOL threadOverflow;
+
+    // the same for the readers merged into the last holder slot
+    UINT64 mergedMask;
+
+    BOOL mergedOverflow;
+
+    UINT64 accesses;
+
+    UINT64 trueSharing;
+
+    UINT64 falseSharing;
+
+    // PCs of the invalidating writes and of the invalidated holders
+    sharing_pc_t pcs[SHARING_PCS];
+};
+
+struct sharing_shard_t : locked_shard_t
+{
+    std::unordered_map<ADDRINT, sharing_line_t> lines;
+};
+
+sharing_shard_t sharingShards[SHARING_SHARDS];
+
+static inline sharing_shard_t& SharingShard(ADDRINT line)
+{
+    return sharingShards[(line ^ (line >> 8) ^ (line >> 16)) % SHARING_SHARDS];
+}
+
+static inline VOID SharingAddThread(UINT64 &mask, BOOL &overflow, UINT32 threadNum)
+{
+    if (threadNum < 64)
+    {
+        mask |= 1ULL << threadNum;
+    }
+    else
+    {
+        overflow = TRUE;
+    }
+}
+
+// TRUE if threadNum is the only reader merged into the last holder slot
+static inline BOOL SharingOnlyMergedReader(const sharing_line_t &line, UINT32 threadNum)
+{
+    return (threadNum < 64) && ! line.mergedOverflow && (line.mergedMask == (1ULL << threadNum));
+}
+
+static inline UINT64 SharingByteMask(UINT32 offset, UINT32 size)
+{
+    return (size >= 64) ? ~0ULL : (((1ULL << size) - 1) << offset);
+}
+
+VOID SharingAddPc(sharing_line_t *line, ADDRINT pc)
+{
+    sharing_pc_t *least = &line->pcs[0];
+
+    for (UINT32 i = 0; i < SHARING_PCS; i++)
+    {
+        if (line->pcs[i].pc == pc)
+        {
+            line->pcs[i].count++;
+            return;
+        }
+        if (line->pcs[i].count < least->count)
+        {
+            least = &line->pcs[i];
+        }
+    }
+
+    // replace the least frequent one
+    least->pc = pc;
+    least->count = 1;
+}
+
+VOID SharingAccessLine(ADDRINT lineAddr, UINT64 bytes, BOOL write, ADDRINT pc, MLOG *mlog)
+{
+    UINT32 threadNum = (UINT32)mlog->threadNum;
+
+    sharing_shard_t &shard = SharingShard(lineAddr);
+
+    PIN_GetLock(&shard.lock, threadNum + 1);
+
+    sharing_line_t &line = shard.lines[lineAddr];
+
+    line.accesses++;
+    SharingAddThread(line.threadMask, line.threadOverflow, threadNum);
+
+    if (write)
+    {
+        UINT64 otherBytes = 0;
+        UINT64 ownBytes = 0;
+        BOOL others = FALSE;
+
+        for (UINT32 i = 0; i < line.holderCount; i++)
+        {
+            if ((line.holders[i].threadNum == threadNum)
+             || ((line.holders[i].threadNum == SHARING_MERGED_HOLDER) && SharingOnlyMergedReader(line, threadNum)))
+            {
+                ownBytes |= line.holders[i].bytes;
+                continue;
+            }
+
+            others = TRUE;
+            otherBytes |= line.holders[i].bytes;
+            SharingAddPc(&line, line.holders[i].pc);
+        }
+
+        if (others)
+        {
+            if (otherBytes & bytes)
+            {
+                line.trueSharing++;
+            }
+            else
+            {
+                line.falseSharing++;
+            }
+
+            SharingAddPc(&line, pc);
+        }
+
+        // the writer is the only holder now
+        line.holders[0].threadNum = threadNum;
+        line.holders[0].bytes = ownBytes | bytes;
+        line.holders[0].pc = pc;
+        line.holderCount = 1;
+        line.mergedMask = 0;
+        line.mergedOverflow = FALSE;
+    }
+    else
+    {
+        UINT32 i = 0;
+
+        while ((i < line.holderCount) && (line.holders[i].threadNum != threadNum))
+        {
+            i++;
+        }
+
+        if (i == line.holderCount)
+        {
+            if (i == SHARING_HOLDERS)
+            {
+                // no room, the last slot stands for all further readers,
+                // starting with the one it held
+                i = SHARING_HOLDERS - 1;
+
+                if (line.holders[i].threadNum != SHARING_MERGED_HOLDER)
+                {
+                    SharingAddThread(line.mergedMask, line.mergedOverflow, line.holders[i].threadNum);
+                    line.holders[i].threadNum = SHARING_MERGED_HOLDER;
+                }
+
+                SharingAddThread(line.mergedMask, line.mergedOverflow, threadNum);
+            }
+            else
+            {
+                line.holders[i].threadNum = threadNum;
+                line.holders[i].bytes = 0;
+                line.holderCount++;
+            }
+        }
+
+        line.holders[i].bytes |= bytes;
+        line.holders[i].pc = pc;
+    }
+
+    PIN_ReleaseLock(&shard.lock);
+}
+
+VOID SharingAccess(ADDRINT addr, UINT32 size, BOOL write, ADDRINT pc, MLOG *mlog)
+{
+    // an access may span two lines
+    ADDRINT end = addr + (size > 0 ? size : 1);
+
+    while (addr < end)
+    {
+        ADDRINT lineAddr = addr >> SHARING_LINE_SHIFT;
+        UINT32 offset = addr & ((1 << SHARING_LINE_SHIFT) - 1);
+        UINT32 inLine = (end - addr < (ADDRINT)(64 - offset)) ? (UINT32)(end - addr) : 64 - offset;
+
+        SharingAccessLine(lineAddr, SharingByteMask(offset, inLine), write, pc, mlog);
+
+        addr += inLine;
+    }
+}
+
+VOID SharingRead(ADDRINT addr, UINT32 size, ADDRINT pc, MLOG* mlog)
+{
+    SharingAccess(addr, size, FALSE, pc, mlog);
+}
+
+VOID SharingWrite(ADDRINT addr, UINT32 size, ADDRINT pc, MLOG* mlog)
+{
+    SharingAccess(addr, size, TRUE, pc, mlog);
+}
+
+VOID InstrumentSharing(BBL bbl)
+{
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+        for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        {
+            UINT32 size = INS_MemoryOperandSize(ins, memOp);
+
+            if (INS_MemoryOperandIsRead(ins, memOp))
+            {
+                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)SharingRead,
+                        IARG_MEMORYOP_EA, memOp, IARG_UINT32, size, IARG_INST_PTR, IARG_REG_VALUE, mlog_reg,
+                        IARG_END);
+            }
+            if (INS_MemoryOperandIsWritten(ins, memOp))
+            {
+                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)SharingWrite,
+                        IARG_MEMORYOP_EA, memOp, IARG_UINT32, size, IARG_INST_PTR, IARG_REG_VALUE, mlog_reg,
+                        IARG_END);
+            }
+        }
+    }
+}
+
+VOID InitSharing()
+{
+    for (UINT32 i = 0; i < SHARING_SHARDS; i++)
+    {
+        PIN_InitLock(&sharingShards[i].lock);
+    }
+}
+
+static BOOL MoreInvalidations(const pair<ADDRINT, const sharing_line_t*> &a, const pair<ADDRINT, const sharing_line_t*> &b)
+{
+    return (a.second->trueSharing + a.second->falseSharing) > (b.second->trueSharing + b.second->falseSharing);
+}
+
+// called at exit, when no application thread runs anymore
+VOID WriteSharingReport()
+{
+    vector<pair<ADDRINT, const sharing_line_t*> > shared;
+
+    UINT64 lines = 0;
+    UINT64 trueTotal = 0;
+    UINT64 falseTotal = 0;
+
+    for (UINT32 i = 0; i < SHARING_SHARDS; i++)
+    {
+        std::unordered_map<ADDRINT, sharing_line_t>::const_iterator it;
+
+        for (it = sharingShards[i].lines.begin(); it != sharingShards[i].lines.end(); ++it)
+        {
+            lines++;
+
+            if (it->second.trueSharing + it->second.falseSharing > 0)
+            {
+                shared.push_back(std::make_pair(it->first, &it->second));
+                trueTotal += it->second.trueSharing;
+                falseTotal += it->second.falseSharing;
+            }
+        }
+    }
+
+    std::sort(shared.begin(), shared.end(), MoreInvalidations);
+
+    const string fileName = RunFileName("sharing.txt");
+    ofstream out(fileName.c_str());
+
+    out << "lines " << lines << " shared " << shared.size()
+        << " invalidations " << (trueTotal + falseTotal)
+        << " true " << trueTotal << " false " << falseTotal << endl;
+
+    out << "line invalidations true false accesses threads pcs" << endl;
+
+    for (size_t i = 0; (i < shared.size()) && (i < KnobSharingTop.Value()); i++)
+    {
+        const sharing_line_t *line = shared[i].second;
+
+        out << "0x" << std::hex << (shared[i].first << SHARING_LINE_SHIFT) << std::dec
+            << " " << (line->trueSharing + line->falseSharing)
+            << " " << line->trueSharing
+            << " " << line->falseSharing
+            << " " << line->accesses
+            << " " << (line->threadOverflow ? ">=" : "")
+            << (__builtin_popcountll(line->threadMask) + (line->threadOverflow ? 1 : 0));
+
+        for (UINT32 p = 0; p < SHARING_PCS; p++)
+        {
+            if (line->pcs[p].count == 0)
+            {
+                continue;
+            }
+
+            string name = RTN_FindNameByAddress(line->pcs[p].pc);
+
+            out << " 0x" << std::hex << line->pcs[p].pc << std::dec
+                << ":" << (name.empty() ? "?" : name)
+                << ":" << line->pcs[p].count;
+        }
+
+        out << endl;
+    }
+
+    cout << "Sharing: " << shared.size() << " of " << lines << " lines invalidated across threads, "
+         << trueTotal << " true / " << falseTotal << " false sharing invalidations, see " << fileName << endl;
+}
+
+/* ===================================================================== */
+/* Cache filter                                                          */
+/* ===================================================================== */
+
+// -mode cachefilter runs every data access through a private L1D and L2 per
+// thread and an LLC shared by all threads, all LRU, and writes only the
+// accesses that miss to miss_<n> as cache_miss_t records. Each record has the
+// number of instructions since the previous one, so the instruction stream
+// can be rebuilt in between. -cache_emit l2 also writes the L2 misses that hit
+// in the LLC. The per-thread hit and miss counts go to cachefilter_threads.txt.
+
+#define CACHE_LINE_SHIFT 6
+
+#define CACHE_INVALID_TAG (~0ULL)
+
+// the LLC sets are guarded by this many locks
+#define LLC_LOCKS 64
+
+#define CACHE_LEVEL_NONE 0  // only instructions, the gap did not fit in 32 bits
+#define CACHE_LEVEL_LLC  2  // missed L2, hit the LLC
+#define CACHE_LEVEL_MEM  3  // missed the LLC
+
+typedef struct cache_miss
+{
+    UINT64 ip;
+
+    UINT64 addr;
+
+    // instructions from the previous record of the thread to this one
+    UINT32 gap;
+
+    UINT8 isWrite;
+
+    UINT8 level;
+
+    UINT16 reserved;
+
+} cache_miss_t;
+
+KNOB<UINT32> KnobL1dSize(KNOB_MODE_WRITEONCE, "pintool",
+    "l1d_size", "32", "-mode cachefilter: L1D size per thread in KB");
+
+KNOB<UINT32> KnobL1dAssoc(KNOB_MODE_WRITEONCE, "pintool",
+    "l1d_assoc", "8", "-mode cachefilter: L1D associativity");
+
+KNOB<UINT32> KnobL2Size(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_size", "1024", "-mode cachefilter: L2 size per thread in KB");
+
+KNOB<UINT32> KnobL2Assoc(KNOB_MODE_WRITEONCE, "pintool",
+    "l2_assoc", "16", "-mode cachefilter: L2 associativity");
+
+KNOB<UINT32> KnobLlcSize(KNOB_MODE_WRITEONCE, "pintool",
+    "llc_size", "8192", "-mode cachefilter: shared LLC size in KB");
+
+KNOB<UINT32> KnobLlcAssoc(KNOB_MODE_WRITEONCE, "pintool",
+    "llc_assoc", "16", "-mode cachefilter: LLC associativity");
+
+KNOB<string> KnobCacheEmit(KNOB_MODE_WRITEONCE, "pintool",
+    "cache_emit", "llc", "-mode cachefilter: write the accesses that miss the llc or the l2");
+
+// Set-associative LRU cache of line addresses, the ways of a set are kept
+// in MRU order.
+class CacheModel
+{
+  public:
+
+    CacheModel(UINT32 sizeKB, UINT32 associativity)
+    {
+        assoc = associativity;
+        sets = (UINT64)sizeKB * 1024 / (1 << CACHE_LINE_SHIFT) / assoc;
+        tags.assign(sets * assoc, CACHE_INVALID_TAG);
+        hits = 0;
+        misses = 0;
+    }
+
+    UINT64 setOf(UINT64 line) const
+    {
+        return line % sets;
+    }
+
+    // TRUE on a hit, a miss allocates the line
+    BOOL access(UINT64 line)
+    {
+        UINT64 *ways = &tags[setOf(line) * assoc];
+        UINT32 way = 0;
+
+        while ((way < assoc - 1) && (ways[way] != line))
+        {
+            way++;
+        }
+
+        BOOL hit = (ways[way] == line);
+
+        // the hit way or the LRU one moves to the front
+        memmove(ways + 1, ways, way * sizeof(UINT64));
+        ways[0] = line;
+
+        if (hit)
+        {
+            hits++;
+        }
+        else
+        {
+            misses++;
+        }
+
+        return hit;
+    }
+
+    UINT64 sets;
+
+    UINT32 assoc;
+
+    vector<UINT64> tags;
+
+    UINT64 hits;
+
+    UINT64 misses;
+};
+
+CacheModel *llc = NULL;
+
+PIN_LOCK llcLocks[LLC_LOCKS];
+
+UINT32 cacheEmitLevel = CACHE_LEVEL_MEM;
+
+PIN_LOCK cachefilter_lock;
+
+ofstream cacheFilterThreads;
+
+// sums of the finished threads' llcHits / llcMisses, under cachefilter_lock
+UINT64 llcHitsTotal = 0;
+
+UINT64 llcMissesTotal = 0;
+
+BOOL ValidCacheGeometry(const char *name, UINT32 sizeKB, UINT32 assoc)
+{
+    if ((assoc == 0) || ((UINT64)sizeKB * 1024 < (UINT64)assoc << CACHE_LINE_SHIFT))
+    {
+        cerr << "Error: " << name << " of " << sizeKB << "KB cannot have " << assoc << " ways of 64B lines" << endl;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID InitCacheFilter()
+{
+    if ( ! ValidCacheGeometry("l1d", KnobL1dSize.Value(), KnobL1dAssoc.Value())
+      || ! ValidCacheGeometry("l2", KnobL2Size.Value(), KnobL2Assoc.Value())
+      || ! ValidCacheGeometry("llc", KnobLlcSize.Value(), KnobLlcAssoc.Value()))
+    {
+        PIN_ExitProcess(1);
+    }
+
+    if (KnobCacheEmit.Value() == "l2")
+    {
+        cacheEmitLevel = CACHE_LEVEL_LLC;
+    }
+    else if (KnobCacheEmit.Value() != "llc")
+    {
+        cerr << "Error: unknown -cache_emit value " << KnobCacheEmit.Value() << endl;
+        PIN_ExitProcess(1);
+    }
+
+    llc = new CacheModel(KnobLlcSize.Value(), KnobLlcAssoc.Value());
+
+    for (UINT32 i = 0; i < LLC_LOCKS; i++)
+    {
+        PIN_InitLock(&llcLocks[i]);
+    }
+
+    PIN_InitLock(&cachefilter_lock);
+
+    const string fileName = RunFileName("cachefilter_threads.txt");
+    cacheFilterThreads.open(fileName.c_str());
+}
+
+VOID StartCacheFilter(MLOG *mlog)
+{
+    mlog->l1d = new CacheModel(KnobL1dSize.Value(), KnobL1dAssoc.Value());
+    mlog->l2 = new CacheModel(KnobL2Size.Value(), KnobL2Assoc.Value());
+    mlog->lastMissIns = 0;
+    mlog->llcHits = 0;
+    mlog->llcMisses = 0;
+    mlog->missWriter = OpenStreamWriter("miss", mlog->threadNum, mlog->osTid);
+}
+
+VOID CacheFilterLine(UINT64 line, ADDRINT addr, BOOL write, ADDRINT ip, UINT64 insNum, MLOG *mlog)
+{
+    if (mlog->l1d->access(line) || mlog->l2->access(line))
+    {
+        return;
+    }
+
+    PIN_LOCK *lock = &llcLocks[llc->setOf(line) % LLC_LOCKS];
+
+    PIN_GetLock(lock, mlog->threadNum + 1);
+    BOOL llcHit = llc->access(line);
+    PIN_ReleaseLock(lock);
+
+    if (llcHit)
+    {
+        mlog->llcHits++;
+    }
+    else
+    {
+        mlog->llcMisses++;
+    }
+
+    UINT8 level = llcHit ? CACHE_LEVEL_LLC : CACHE_LEVEL_MEM;
+
+    if (level < cacheEmitLevel)
+    {
+        return;
+    }
+
+    cache_miss_t record;
+    memset(&record, 0, sizeof(record));
+
+    UINT64 gap = insNum - mlog->lastMissIns;
+
+    // stretches without misses longer than a gap can hold
+    while (gap > 0xFFFFFFFFULL)
+    {
+        record.gap = 0xFFFFFFFFU;
+        record.level = CACHE_LEVEL_NONE;
+        mlog->missWriter->append(&record, sizeof(record));
+        gap -= 0xFFFFFFFFULL;
+    }
+
+    record.ip = ip;
+    record.addr = addr;
+    record.gap = (UINT32)gap;
+    record.isWrite = write ? 1 : 0;
+    record.level = level;
+
+    mlog->missWriter->append(&record, sizeof(record));
+
+    mlog->lastMissIns = insNum;
+}
+
+// blockRemaining: instructions of the block after this one, insNum is
+// already counted to the end of the block
+VOID CacheFilterAccess(ADDRINT addr, UINT32 size, BOOL write, ADDRINT ip, UINT32 blockRemaining, MLOG* mlog)
+{
+    UINT64 insNum = mlog->insNum - blockRemaining;
+
+    if ((insNum <= mlog->traceStart) || (insNum > mlog->traceEnd))
+    {
+        return;
+    }
+
+    UINT64 first = addr >> CACHE_LINE_SHIFT;
+    UINT64 last = (addr + (size > 0 ? size - 1 : 0)) >> CACHE_LINE_SHIFT;
+
+    for (UINT64 line = first; line <= last; line++)
+    {
+        CacheFilterLine(line, addr, write, ip, insNum, mlog);
+    }
+}
+
+VOID InstrumentCacheFilter(BBL bbl)
+{
+    UINT32 remaining = BBL_NumIns(bbl);
+
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        remaining--;
+
+        UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+        for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        {
+            UINT32 size = INS_MemoryOperandSize(ins, memOp);
+
+            if (INS_MemoryOperandIsRead(ins, memOp))
+            {
+                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)CacheFilterAccess,
+                        IARG_MEMORYOP_EA, memOp, IARG_UINT32, size, IARG_BOOL, FALSE, IARG_INST_PTR,
+                        IARG_UINT32, remaining, IARG_REG_VALUE, mlog_reg, IARG_END);
+            }
+            if (INS_MemoryOperandIsWritten(ins, memOp))
+            {
+                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)CacheFilterAccess,
+                        IARG_MEMORYOP_EA, memOp, IARG_UINT32, size, IARG_BOOL, TRUE, IARG_INST_PTR,
+                        IARG_UINT32, remaining, IARG_REG_VALUE, mlog_reg, IARG_END);
+            }
+        }
+    }
+}
+
+VOID FinishCacheFilter(MLOG *mlog, THREADID tid)
+{
+    mlog->missWriter->close();
+    mlog->missWriter = NULL;
+
+    PIN_GetLock(&cachefilter_lock, tid + 1);
+
+    cacheFilterThreads << "thread " << mlog->threadNum
+                       << " pin_tid " << tid
+                       << " os_tid " << mlog->osTid
+                       << " instructions " << mlog->insNum
+                       << " l1d_hits " << mlog->l1d->hits
+                       << " l1d_misses " << mlog->l1d->misses
+                       << " l2_hits " << mlog->l2->hits
+                       << " l2_misses " << mlog->l2->misses
+                       << " llc_hits " << mlog->llcHits
+                       << " llc_misses " << mlog->llcMisses << endl;
+
+    llcHitsTotal += mlog->llcHits;
+    llcMissesTotal += mlog->llcMisses;
+
+    PIN_ReleaseLock(&cachefilter_lock);
+
+    delete mlog->l1d;
+    delete mlog->l2;
+    mlog->l1d = NULL;
+    mlog->l2 = NULL;
+}
+
+// called at exit
+VOID WriteCacheFilterSummary()
+{
+    cacheFilterThreads << "llc hits " << llcHitsTotal << " misses " << llcMissesTotal << endl;
+    cacheFilterThreads.close();
+}
+
+/* ===================================================================== */
+/* Count-only profile                                                    */
+/* ===================================================================== */
+
+// -mode profile only counts: one inline call per basic block adds its
+// instructions, memory operands and branches to the thread's padded
+// thread_data_t. An internal thread samples the counters of all threads
+// every -profile_interval milliseconds into profile.csv, one line per
+// thread and sample with the counts so far, which is enough to size runs
+// and find phases before tracing them.
+
+KNOB<UINT32> KnobProfileInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "profile_interval", "100", "milliseconds between two samples of -mode profile");
+
+struct profile_thread_t
+{
+    UINT64 threadNum;
+    OS_THREAD_ID osTid;
+    thread_data_t *counters;
+
+    // sampled once more after the thread is gone, then dropped
+    BOOL finished;
+};
+
+// threads to sample, under profile_lock
+vector<profile_thread_t> profileThreads;
+
+PIN_LOCK profile_lock;
+
+ofstream profileFile;
+
+PIN_SEMAPHORE profileStop;
+
+PIN_THREAD_UID profileSamplerUid;
+
+BOOL profileSamplerRunning = FALSE;
+
+struct timespec profileStart;
+
+UINT64 profileSamples = 0;
+
+UINT64 profileThreadCount = 0;
+
+VOID PIN_FAST_ANALYSIS_CALL ProfileCountBlock(UINT32 numIns, UINT32 memOps, UINT32 branches, MLOG* mlog)
+{
+    thread_data_t *counters = mlog->profile;
+
+    mlog->insNum += numIns;
+
+    counters->_count += numIns;
+    counters->_memOps += memOps;
+    counters->_branches += branches;
+}
+
+VOID InstrumentProfile(BBL bbl)
+{
+    UINT32 memOps = 0;
+    UINT32 branches = 0;
+
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        memOps += INS_MemoryOperandCount(ins);
+
+        if (INS_IsControlFlow(ins))
+        {
+            branches++;
+        }
+    }
+
+    BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)ProfileCountBlock, IARG_FAST_ANALYSIS_CALL,
+            IARG_UINT32, BBL_NumIns(bbl), IARG_UINT32, memOps, IARG_UINT32, branches,
+            IARG_REG_VALUE, mlog_reg, IARG_END);
+}
+
+UINT64 ProfileElapsedMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - profileStart.tv_sec) * 1000ULL + (now.tv_nsec - profileStart.tv_nsec) / 1000000;
+}
+
+VOID AppendProfileLine(std::ostringstream &lines, UINT64 ms, const profile_thread_t &thread)
+{
+    const thread_data_t *counters = thread.counters;
+
+    lines << ms << "," << thread.threadNum << "," << thread.osTid << "," << counters->_count
+          << "," << counters->_memOps << "," << counters->_branches << "\n";
+}
+
+// The counters are read while their threads run, a sample is not a
+// consistent cut across threads.
+VOID WriteProfileSample()
+{
+    const UINT64 ms = ProfileElapsedMs();
+
+    std::ostringstream lines;
+
+    PIN_GetLock(&profile_lock, 1);
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < profileThreads.size(); i++)
+    {
+        const profile_thread_t &thread = profileThreads[i];
+
+        AppendProfileLine(lines, ms, thread);
+
+        if (thread.finished)
+        {
+            delete thread.counters;
+        }
+        else
+        {
+            profileThreads[kept++] = thread;
+        }
+    }
+
+    profileThreads.resize(kept);
+    profileSamples++;
+
+    // under the lock, threads finishing after the sampler write here too
+    profileFile << lines.str();
+    profileFile.flush();
+
+    PIN_ReleaseLock(&profile_lock);
+}
+
+VOID ProfileSampler(VOID *arg)
+{
+    while ( ! PIN_SemaphoreTimedWait(&profileStop, KnobProfileInterval.Value()))
+    {
+        WriteProfileSample();
+    }
+}
+
+// Internal threads have to be gone before Fini, the last sample has the
+// final counts of the threads still running.
+VOID StopProfileSampler(VOID *v)
+{
+    if ( ! profileSamplerRunning)
+    {
+        return;
+    }
+
+    PIN_GetLock(&profile_lock, 1);
+    profileSamplerRunning = FALSE;
+    PIN_ReleaseLock(&profile_lock);
+
+    PIN_SemaphoreSet(&profileStop);
+    PIN_WaitForThreadTermination(profileSamplerUid, PIN_INFINITE_TIMEOUT, NULL);
+
+    WriteProfileSample();
+}
+
+void InitProfile()
+{
+    if (KnobProfileInterval.Value() == 0)
+    {
+        cerr << "Error: -profile_interval must be at least 1" << endl;
+        PIN_ExitProcess(1);
+    }
+
+    PIN_InitLock(&profile_lock);
+    PIN_SemaphoreInit(&profileStop);
+
+    const string fileName = RunFileName("profile.csv");
+    profileFile.open(fileName.c_str());
+    profileFile << "time_ms,thread,os_tid,instructions,memory_ops,branches\n";
+
+    clock_gettime(CLOCK_MONOTONIC, &profileStart);
+
+    if (PIN_SpawnInternalThread(ProfileSampler, NULL, 0, &profileSamplerUid) == INVALID_THREADID)
+    {
+        cerr << "Error: could not spawn profile sampler thread." << endl;
+        PIN_ExitProcess(1);
+    }
+
+    profileSamplerRunning = TRUE;
+
+    PIN_AddPrepareForFiniFunction(StopProfileSampler, NULL);
+}
+
+VOID StartProfile(MLOG *mlog)
+{
+    mlog->profile = new thread_data_t;
+
+    profile_thread_t thread;
+    thread.threadNum = mlog->threadNum;
+    thread.osTid = mlog->osTid;
+    thread.counters = mlog->profile;
+    thread.finished = FALSE;
+
+    PIN_GetLock(&profile_lock, mlog->threadNum + 1);
+    profileThreads.push_back(thread);
+    profileThreadCount++;
+    PIN_ReleaseLock(&profile_lock);
+}
+
+// The counters are freed by the sampler once they are written out. Once
+// the sampler has stopped, the thread writes its last counts and frees
+// them itself.
+VOID FinishProfile(MLOG *mlog)
+{
+    PIN_GetLock(&profile_lock, mlog->threadNum + 1);
+
+    for (size_t i = 0; i < profileThreads.size(); i++)
+    {
+        if (profileThreads[i].counters != mlog->profile)
+        {
+            continue;
+        }
+
+        if (profileSamplerRunning)
+        {
+            profileThreads[i].finished = TRUE;
+            break;
+        }
+
+        std::ostringstream line;
+        AppendProfileLine(line, ProfileElapsedMs(), profileThreads[i]);
+
+        profileFile << line.str();
+        profileFile.flush();
+
+        profileThreads.erase(profileThreads.begin() + i);
+        delete mlog->profile;
+        break;
+    }
+
+    PIN_ReleaseLock(&profile_lock);
+
+    mlog->profile = NULL;
+}
+
+VOID WriteProfileSummary()
+{
+    cout << "profile: " << profileThreadCount << " threads, " << profileSamples
+         << " samples in " << RunFileName("profile.csv") << endl;
+}
+
+/* ===================================================================== */
+/* Page working set                                                      */
+/* ===================================================================== */
+
+// -mode pages writes no trace; it records which threads touch which pages,
+// for NUMA placement. Every thread counts its reads and writes per 4K page
+// in a hash table of its own, so the counting takes no lock. The first
+// access of a thread to a page also goes to a table shared by all threads,
+// split into PAGES_SHARDS hash tables with a lock each, which keeps the
+// thread that touched the 4K and the 2M page first (the thread the kernel
+// places it near under first-touch). Every -pages_interval instructions a
+// thread writes the number of 4K and 2M pages it touched in the interval to
+// pages_intervals.csv. At exit the per-thread counts are merged into the
+// thread-by-page matrices pages_4k.csv and pages_2m.csv, the accesses per
+// thread and first-touch thread into pages_first_touch.csv, and a summary
+// with every thread's local and remote accesses into pages.txt. An access
+// is counted on the page of its first byte.
+
+#define PAGE_4K_SHIFT 12
+#define PAGE_2M_SHIFT 21
+
+#define PAGES_SHARDS 256
+
+KNOB<UINT64> KnobPagesInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "pages_interval", "10000000", "-mode pages: instructions per working set interval of a thread");
+
+struct page_count_t
+{
+    page_count_t() : reads(0), writes(0), intervalTag(0) {}
+
+    UINT64 reads;
+
+    UINT64 writes;
+
+    // intervals + 1 of the last interval the page was touched in, 0 for none
+    UINT64 intervalTag;
+};
+
+// the thread that touched a page first, and its instruction number then
+struct page_owner_t
+{
+    UINT32 threadNum;
+
+    UINT64 insNum;
+};
+
+struct page_shard_t : locked_shard_t
+{
+    // keyed by page number, a 4K page is in the shard of its 2M page
+    std::unordered_map<ADDRINT, page_owner_t> pages4k;
+
+    std::unordered_map<ADDRINT, page_owner_t> pages2m;
+};
+
+page_shard_t pageShards[PAGES_SHARDS];
+
+// per thread, only touched by the thread itself until the report at exit
+struct pages_thread_t
+{
+    UINT64 threadNum;
+
+    OS_THREAD_ID osTid;
+
+    UINT64 instructions;
+
+    std::unordered_map<ADDRINT, page_count_t> pages4k;
+
+    // intervalTag of every 2M page
+    std::unordered_map<ADDRINT, UINT64> pages2m;
+
+    UINT64 intervals;
+
+    UINT64 intervalFirstIns;
+
+    UINT64 intervalEnd;
+
+    // pages touched in the current interval, and 4K pages touched for the first time
+    UINT64 interval4k;
+
+    UINT64 interval2m;
+
+    UINT64 intervalNew4k;
+};
+
+// all threads, under pages_lock
+vector<pages_thread_t*> pagesThreads;
+
+PIN_LOCK pages_lock;
+
+ofstream pagesIntervals;
+
+static inline page_shard_t& PageShard(ADDRINT page2m)
+{
+    return pageShards[(page2m ^ (page2m >> 8)) % PAGES_SHARDS];
+}
+
+VOID PagesFirstTouch(ADDRINT page, UINT64 insNum, MLOG *mlog)
+{
+    const ADDRINT page2m = page >> (PAGE_2M_SHIFT - PAGE_4K_SHIFT);
+
+    page_owner_t owner;
+    owner.threadNum = (UINT32)mlog->threadNum;
+    owner.insNum = insNum;
+
+    page_shard_t &shard = PageShard(page2m);
+
+    PIN_GetLock(&shard.lock, mlog->threadNum + 1);
+
+    // no-ops if another thread was first
+    shard.pages4k.insert(std::make_pair(page, owner));
+    shard.pages2m.insert(std::make_pair(page2m, owner));
+
+    PIN_ReleaseLock(&shard.lock);
+}
+
+// Count of a page the thread did not access last.
+page_count_t* PagesTouch(ADDRINT page, UINT64 insNum, MLOG *mlog)
+{
+    pages_thread_t *pages = mlog->pages;
+
+    std::pair<std::unordered_map<ADDRINT, page_count_t>::iterator, bool> inserted =
+        pages->pages4k.insert(std::make_pair(page, page_count_t()));
+
+    page_count_t *count = &inserted.first->second;
+
+    if (inserted.second)
+    {
+        PagesFirstTouch(page, insNum, mlog);
+        pages->intervalNew4k++;
+    }
+
+    const UINT64 tag = pages->intervals + 1;
+
+    if (count->intervalTag != tag)
+    {
+        count->intervalTag = tag;
+        pages->interval4k++;
+
+        UINT64 &tag2m = pages->pages2m[page >> (PAGE_2M_SHIFT - PAGE_4K_SHIFT)];
+
+        if (tag2m != tag)
+        {
+            tag2m = tag;
+            pages->interval2m++;
+        }
+    }
+
+    // elements of an unordered_map stay where they are when it grows
+    mlog->pageLast = page;
+    mlog->pageLastCount = count;
+
+    return count;
+}
+
+// blockRemaining: instructions of the block after this one, insNum is
+// already counted to the end of the block
+VOID PagesAccess(ADDRINT addr, BOOL write, UINT32 blockRemaining, MLOG* mlog)
+{
+    UINT64 insNum = mlog->insNum - blockRemaining;
+
+    if ((insNum <= mlog->traceStart) || (insNum > mlog->traceEnd))
+    {
+        return;
+    }
+
+    const ADDRINT page = addr >> PAGE_4K_SHIFT;
+
+    page_count_t *count = (page == mlog->pageLast) ? mlog->pageLastCount : PagesTouch(page, insNum, mlog);
+
+    if (write)
+    {
+        count->writes++;
+    }
+    else
+    {
+        count->reads++;
+    }
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL PagesCountBlock(UINT32 numIns, MLOG* mlog)
+{
+    mlog->insNum += numIns;
+
+    return mlog->insNum >= mlog->pages->intervalEnd;
+}
+
+VOID WritePagesInterval(MLOG *mlog)
+{
+    pages_thread_t *pages = mlog->pages;
+
+    std::ostringstream line;
+    line << pages->threadNum << "," << pages->intervals << "," << pages->intervalFirstIns
+         << "," << (mlog->insNum - pages->intervalFirstIns) << "," << pages->interval4k
+         << "," << pages->interval2m << "," << pages->intervalNew4k << "\n";
+
+    PIN_GetLock(&pages_lock, mlog->threadNum + 1);
+    pagesIntervals << line.str();
+    PIN_ReleaseLock(&pages_lock);
+
+    pages->instructions = mlog->insNum;
+    pages->intervals++;
+    pages->intervalFirstIns = mlog->insNum;
+    pages->intervalEnd = mlog->insNum + KnobPagesInterval.Value();
+    pages->interval4k = 0;
+    pages->interval2m = 0;
+    pages->intervalNew4k = 0;
+
+    // the next access to the cached page has to count it in the new interval
+    mlog->pageLast = ~(ADDRINT)0;
+    mlog->pageLastCount = NULL;
+}
+
+VOID InstrumentPages(BBL bbl)
+{
+    UINT32 remaining = BBL_NumIns(bbl);
+
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)PagesCountBlock, IARG_FAST_ANALYSIS_CALL,
+            IARG_UINT32, remaining, IARG_REG_VALUE, mlog_reg, IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)WritePagesInterval,
+            IARG_REG_VALUE, mlog_reg, IARG_END);
+
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        remaining--;
+
+        UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+        for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+        {
+            if (INS_MemoryOperandIsRead(ins, memOp))
+            {
+                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)PagesAccess,
+                        IARG_MEMORYOP_EA, memOp, IARG_BOOL, FALSE,
+                        IARG_UINT32, remaining, IARG_REG_VALUE, mlog_reg, IARG_END);
+            }
+            if (INS_MemoryOperandIsWritten(ins, memOp))
+            {
+                INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)PagesAccess,
+                        IARG_MEMORYOP_EA, memOp, IARG_BOOL, TRUE,
+                        IARG_UINT32, remaining, IARG_REG_VALUE, mlog_reg, IARG_END);
+            }
+        }
+    }
+}
+
+VOID InitPages()
+{
+    if (KnobPagesInterval.Value() == 0)
+    {
+        cerr << "Error: -pages_interval must be at least 1" << endl;
+        PIN_ExitProcess(1);
+    }
+
+    PIN_InitLock(&pages_lock);
+
+    for (UINT32 i = 0; i < PAGES_SHARDS; i++)
+    {
+        PIN_InitLock(&pageShards[i].lock);
+    }
+
+    const string fileName = RunFileName("pages_intervals.csv");
+    pagesIntervals.open(fileName.c_str());
+    pagesIntervals << "thread,interval,first_ins,instructions,pages_4k,pages_2m,new_pages_4k\n";
+}
+
+VOID StartPages(MLOG *mlog)
+{
+    pages_thread_t *pages = new pages_thread_t;
+
+    pages->threadNum = mlog->threadNum;
+    pages->osTid = mlog->osTid;
+    pages->instructions = 0;
+    pages->intervals = 0;
+    pages->intervalFirstIns = 0;
+    pages->intervalEnd = KnobPagesInterval.Value();
+    pages->interval4k = 0;
+    pages->interval2m = 0;
+    pages->intervalNew4k = 0;
+
+    mlog->pages = pages;
+    mlog->pageLast = ~(ADDRINT)0;
+    mlog->pageLastCount = NULL;
+
+    PIN_GetLock(&pages_lock, mlog->threadNum + 1);
+    pagesThreads.push_back(pages);
+    PIN_ReleaseLock(&pages_lock);
+}
+
+// last partial interval, the counts are merged at exit
+VOID FinishPages(MLOG *mlog)
+{
+    pages_thread_t *pages = mlog->pages;
+
+    if ((mlog->insNum > pages->intervalFirstIns) || (pages->interval4k > 0))
+    {
+        WritePagesInterval(mlog);
+    }
+
+    pages->instructions = mlog->insNum;
+
+    mlog->pages = NULL;
+    mlog->pageLastCount = NULL;
+}
+
+// one cell of a thread-by-page matrix
+struct pages_cell_t
+{
+    ADDRINT page;
+
+    UINT64 threadNum;
+
+    UINT64 reads;
+
+    UINT64 writes;
+};
+
+static BOOL PagesCellLess(const pages_cell_t &a, const pages_cell_t &b)
+{
+    return (a.page != b.page) ? (a.page < b.page) : (a.threadNum < b.threadNum);
+}
+
+struct pages_locality_t
+{
+    pages_locality_t() : local(0), remote(0) {}
+
+    UINT64 local;
+
+    UINT64 remote;
+};
+
+// Writes pages_<granularity>.csv, sorted by page, and adds every cell's
+// accesses to firstTouch (thread, first-touch thread) and to the thread's
+// local or remote count. Returns the number of pages touched by more than
+// one thread.
+UINT64 WritePagesMatrix(vector<pages_cell_t> &cells, const string &granularity, UINT32 shift,
+        map<pair<UINT64, UINT64>, UINT64> &firstTouch, map<UINT64, pages_locality_t> &locality, UINT64 &pageCount)
+{
+    std::sort(cells.begin(), cells.end(), PagesCellLess);
+
+    const string fileName = RunFileName("pages_" + granularity + ".csv");
+    ofstream out(fileName.c_str());
+
+    out << "page,first_touch,first_touch_ins,thread,reads,writes\n";
+
+    UINT64 shared = 0;
+    pageCount = 0;
+
+    for (size_t i = 0; i < cells.size(); i++)
+    {
+        const pages_cell_t &cell = cells[i];
+
+        if ((i == 0) || (cells[i - 1].page != cell.page))
+        {
+            pageCount++;
+
+            if ((i + 1 < cells.size()) && (cells[i + 1].page == cell.page))
+            {
+                shared++;
+            }
+        }
+
+        const ADDRINT page2m = (cell.page << shift) >> PAGE_2M_SHIFT;
+        const page_shard_t &shard = PageShard(page2m);
+        const std::unordered_map<ADDRINT, page_owner_t> &owners = (shift == PAGE_4K_SHIFT) ? shard.pages4k : shard.pages2m;
+
+        const page_owner_t &owner = owners.find(cell.page)->second;
+
+        out << "0x" << std::hex << (cell.page << shift) << std::dec
+            << "," << owner.threadNum << "," << owner.insNum
+            << "," << cell.threadNum << "," << cell.reads << "," << cell.writes << "\n";
+
+        const UINT64 accesses = cell.reads + cell.writes;
+
+        firstTouch[std::make_pair(cell.threadNum, (UINT64)owner.threadNum)] += accesses;
+
+        if (owner.threadNum == cell.threadNum)
+        {
+            locality[cell.threadNum].local += accesses;
+        }
+        else
+        {
+            locality[cell.threadNum].remote += accesses;
+        }
+    }
+
+    return shared;
+}
+
+// called at exit, when no application thread runs anymore
+VOID WritePagesReport()
+{
+    pagesIntervals.close();
+
+    vector<pages_cell_t> cells4k;
+    vector<pages_cell_t> cells2m;
+
+    for (size_t t = 0; t < pagesThreads.size(); t++)
+    {
+        const pages_thread_t *pages = pagesThreads[t];
+
+        // the 2M counts are the sums of the 4K ones
+        std::unordered_map<ADDRINT, pages_cell_t> thread2m;
+
+        std::unordered_map<ADDRINT, page_count_t>::const_iterator it;
+
+        for (it = pages->pages4k.begin(); it != pages->pages4k.end(); ++it)
+        {
+            pages_cell_t cell;
+            cell.page = it->first;
+            cell.threadNum = pages->threadNum;
+            cell.reads = it->second.reads;
+            cell.writes = it->second.writes;
+
+            cells4k.push_back(cell);
+
+            pages_cell_t &cell2m = thread2m[it->first >> (PAGE_2M_SHIFT - PAGE_4K_SHIFT)];
+            cell2m.reads += cell.reads;
+            cell2m.writes += cell.writes;
+        }
+
+        std::unordered_map<ADDRINT, pages_cell_t>::iterator it2m;
+
+        for (it2m = thread2m.begin(); it2m != thread2m.end(); ++it2m)
+        {
+            it2m->second.page = it2m->first;
+            it2m->second.threadNum = pages->threadNum;
+            cells2m.push_back(it2m->second);
+        }
+    }
+
+    map<pair<UINT64, UINT64>, UINT64> firstTouch4k;
+    map<pair<UINT64, UINT64>, UINT64> firstTouch2m;
+    map<UINT64, pages_locality_t> locality4k;
+    map<UINT64, pages_locality_t> locality2m;
+    UINT64 pages4k = 0;
+    UINT64 pages2m = 0;
+
+    const UINT64 shared4k = WritePagesMatrix(cells4k, "4k", PAGE_4K_SHIFT, firstTouch4k, locality4k, pages4k);
+    const UINT64 shared2m = WritePagesMatrix(cells2m, "2m", PAGE_2M_SHIFT, firstTouch2m, locality2m, pages2m);
+
+    const string firstTouchFileName = RunFileName("pages_first_touch.csv");
+    ofstream firstTouch(firstTouchFileName.c_str());
+
+    firstTouch << "page_size,thread,first_touch,accesses\n";
+
+    map<pair<UINT64, UINT64>, UINT64>::const_iterator cell;
+
+    for (cell = firstTouch4k.begin(); cell != firstTouch4k.end(); ++cell)
+    {
+        firstTouch << "4k," << cell->first.first << "," << cell->first.second << "," << cell->second << "\n";
+    }
+
+    for (cell = firstTouch2m.begin(); cell != firstTouch2m.end(); ++cell)
+    {
+        firstTouch << "2m," << cell->first.first << "," << cell->first.second << "," << cell->second << "\n";
+    }
+
+    const string fileName = RunFileName("pages.txt");
+    ofstream out(fileName.c_str());
+
+    out << "pages_4k " << pages4k << " shared " << shared4k
+        << " pages_2m " << pages2m << " shared " << shared2m << endl;
+
+    out << "thread os_tid instructions pages_4k local_4k remote_4k local_2m remote_2m" << endl;
+
+    UINT64 remote4k = 0;
+    UINT64 accesses = 0;
+
+    for (size_t t = 0; t < pagesThreads.size(); t++)
+    {
+        const pages_thread_t *pages = pagesThreads[t];
+        const pages_locality_t &l4k = locality4k[pages->threadNum];
+        const pages_locality_t &l2m = locality2m[pages->threadNum];
+
+        out << pages->threadNum << " " << pages->osTid << " " << pages->instructions
+            << " " << pages->pages4k.size()
+            << " " << l4k.local << " " << l4k.remote
+            << " " << l2m.local << " " << l2m.remote << endl;
+
+        remote4k += l4k.remote;
+        accesses += l4k.local + l4k.remote;
+    }
+
+    cout << "Pages: " << pages4k << " 4K pages (" << shared4k << " shared), " << pages2m << " 2M pages ("
+         << shared2m << " shared), " << remote4k << " of " << accesses
+         << " accesses to 4K pages another thread touched first, see " << fileName << endl;
+}
+
+/* ===================================================================== */
+/* Fast-forward and trace window                                         */
+/* ===================================================================== */
+
+// With a global window the instrumentation is switched as a whole: only an
+// inline instruction counter per basic block while fast-forwarding, the full
+// tracing instrumentation inside the window, and the counter again (or a
+// detach) after it. Threads fold their counts into the global ones every
+// CHECKPOINT_INTERVAL instructions, which is the precision of the switch.
+// With -skip_per_thread every thread gets its own window, so the full
+// instrumentation stays in and RecordInstruction drops what is outside it.
+
+#define PHASE_FAST_FORWARD 0
+#define PHASE_TRACING      1
+#define PHASE_DONE         2
+
+#define CHECKPOINT_INTERVAL (1 << 14)
+
+#define NO_WINDOW_END (~0ULL)
+
+volatile UINT32 tracePhase = PHASE_TRACING;
+
+UINT64 globalSkipped = 0;
+
+UINT64 globalTraced = 0;
+
+BOOL checkWindowEnd = FALSE;
+
+// Move on to the next phase and make Pin re-instrument everything. Only the
+// first thread to get here does the switch.
+BOOL SwitchPhase(UINT32 from, UINT32 to)
+{
+    if ( ! ATOMIC::OPS::CompareAndDidSwap<UINT32>(&tracePhase, from, to))
+    {
+        return FALSE;
+    }
+
+    if ((to == PHASE_DONE) && KnobDetach.Value())
+    {
+        PIN_Detach();
+    }
+    else
+    {
+        PIN_RemoveInstrumentation();
+    }
+
+    return TRUE;
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL CountBasicBlock(UINT32 numIns, MLOG* mlog)
+{
+    mlog->insNum += numIns;
+    mlog->pendingCount += numIns;
+
+    return mlog->pendingCount >= CHECKPOINT_INTERVAL;
+}
+
+VOID FastForwardCheckpoint(UINT32 numIns, CONTEXT *ctxt, MLOG* mlog)
+{
+    UINT64 pending = mlog->pendingCount;
+    mlog->pendingCount = 0;
+
+    UINT64 skipped = ATOMIC::OPS::Increment<UINT64>(&globalSkipped, pending) + pending;
+
+    if ((skipped >= KnobSkip.Value()) && SwitchPhase(PHASE_FAST_FORWARD, PHASE_TRACING))
+    {
+        // this block is executed again with the tracing instrumentation
+        mlog->insNum -= numIns;
+        PIN_ExecuteAt(ctxt);
+    }
+}
+
+VOID WindowCheckpoint(MLOG* mlog)
+{
+    UINT64 pending = mlog->pendingCount;
+    mlog->pendingCount = 0;
+
+    UINT64 traced = ATOMIC::OPS::Increment<UINT64>(&globalTraced, pending) + pending;
+
+    if (traced >= KnobTraceLength.Value())
+    {
+        ClockMarkerAt(mlog, CLOCK_AT_WINDOW_END);
+        SwitchPhase(PHASE_TRACING, PHASE_DONE);
+    }
+}
+
+// Window counting in the tracing phase, insNum is already kept up to date
+// by the per-instruction calls.
+ADDRINT PIN_FAST_ANALYSIS_CALL CountTracedBlock(UINT32 numIns, MLOG* mlog)
+{
+    mlog->pendingCount += numIns;
+
+    return mlog->pendingCount >= CHECKPOINT_INTERVAL;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL CountOnly(UINT32 numIns, MLOG* mlog)
+{
+    mlog->insNum += numIns;
+}
+
+// With -roi the fast-forward phase lasts until the first ROI begin marker and
+// the tracing phase until the first ROI end. The markers are the entries of
+// tracer_roi_begin/tracer_roi_end, found by name in every image, and Sniper's
+// magic xchg %bx,%bx with the command in rax. They are instrumented along
+// with each phase, since SwitchPhase throws away all instrumentation.
+
+// Sniper's SIM_CMD_ROI_START and SIM_CMD_ROI_END
+#define ROI_BEGIN 1
+#define ROI_END   2
+
+BOOL roiTrigger = FALSE;
+
+vector<ADDRINT> roiBeginAddresses;
+vector<ADDRINT> roiEndAddresses;
+
+VOID FindRoiMarkers(IMG img, VOID *v)
+{
+    RTN rtn = RTN_FindByName(img, "tracer_roi_begin");
+
+    if (RTN_Valid(rtn))
+    {
+        roiBeginAddresses.push_back(RTN_Address(rtn));
+    }
+
+    rtn = RTN_FindByName(img, "tracer_roi_end");
+
+    if (RTN_Valid(rtn))
+    {
+        roiEndAddresses.push_back(RTN_Address(rtn));
+    }
+}
+
+// recount is the number of instructions of the block from the marker on,
+// which CountOnly has already counted
+VOID RoiMarker(ADDRINT command, UINT32 recount, CONTEXT *ctxt, MLOG* mlog)
+{
+    if (command == ROI_BEGIN)
+    {
+        if (SwitchPhase(PHASE_FAST_FORWARD, PHASE_TRACING))
+        {
+            // the rest of the block is executed again with the tracing instrumentation
+            mlog->insNum -= recount;
+            PIN_ExecuteAt(ctxt);
+        }
+    }
+    else if (command == ROI_END)
+    {
+        ClockMarkerAt(mlog, CLOCK_AT_WINDOW_END);
+        SwitchPhase(PHASE_TRACING, PHASE_DONE);
+    }
+}
+
+BOOL IsSniperMagic(INS ins)
+{
+    return INS_IsXchg(ins) && INS_OperandIsReg(ins, 0) && INS_OperandIsReg(ins, 1)
+        && (INS_OperandReg(ins, 0) == REG_BX) && (INS_OperandReg(ins, 1) == REG_BX);
+}
+
+VOID InstrumentRoiMarkers(BBL bbl)
+{
+    UINT32 numIns = BBL_NumIns(bbl);
+    UINT32 index = 0;
+
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins), index++)
+    {
+        ADDRINT address = INS_Address(ins);
+
+        if (find(roiBeginAddresses.begin(), roiBeginAddresses.end(), address) != roiBeginAddresses.end())
+        {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RoiMarker, IARG_ADDRINT, (ADDRINT)ROI_BEGIN,
+                    IARG_UINT32, numIns - index, IARG_CONTEXT, IARG_REG_VALUE, mlog_reg, IARG_END);
+        }
+        else if (find(roiEndAddresses.begin(), roiEndAddresses.end(), address) != roiEndAddresses.end())
+        {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RoiMarker, IARG_ADDRINT, (ADDRINT)ROI_END,
+                    IARG_UINT32, numIns - index, IARG_CONTEXT, IARG_REG_VALUE, mlog_reg, IARG_END);
+        }
+        else if (IsSniperMagic(ins))
+        {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RoiMarker, IARG_REG_VALUE, REG_GAX,
+                    IARG_UINT32, numIns - index, IARG_CONTEXT, IARG_REG_VALUE, mlog_reg, IARG_END);
+        }
+    }
+}
+
+VOID Trace(TRACE trace, VOID *v)
+{
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        UINT32 numIns = BBL_NumIns(bbl);
+
+        switch (tracePhase)
+        {
+            case PHASE_FAST_FORWARD:
+                if (roiTrigger)
+                {
+                    BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountOnly, IARG_FAST_ANALYSIS_CALL,
+                            IARG_UINT32, numIns, IARG_REG_VALUE, mlog_reg, IARG_END);
+                    InstrumentRoiMarkers(bbl);
+                    break;
+                }
+
+                BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountBasicBlock, IARG_FAST_ANALYSIS_CALL,
+                        IARG_UINT32, numIns, IARG_REG_VALUE, mlog_reg, IARG_END);
+                BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)FastForwardCheckpoint,
+                        IARG_UINT32, numIns, IARG_CONTEXT, IARG_REG_VALUE, mlog_reg, IARG_END);
+                break;
+
+            case PHASE_TRACING:
+                if (roiTrigger)
+                {
+                    InstrumentRoiMarkers(bbl);
+                }
+
+                if (checkWindowEnd)
+                {
+                    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountTracedBlock, IARG_FAST_ANALYSIS_CALL,
+                            IARG_UINT32, numIns, IARG_REG_VALUE, mlog_reg, IARG_END);
+                    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)WindowCheckpoint,
+                            IARG_REG_VALUE, mlog_reg, IARG_END);
+                }
+
+                if (toolMode == MODE_BBV)
+                {
+                    InstrumentBbv(bbl);
+                    break;
+                }
+
+                if (toolMode == MODE_PROFILE)
+                {
+                    InstrumentProfile(bbl);
+                    break;
+                }
+
+                if (toolMode == MODE_PAGES)
+                {
+                    InstrumentPages(bbl);
+                    break;
+                }
+
+                if ((toolMode == MODE_SHARING) || (toolMode == MODE_CACHE_FILTER))
+                {
+                    BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountOnly, IARG_FAST_ANALYSIS_CALL,
+                            IARG_UINT32, numIns, IARG_REG_VALUE, mlog_reg, IARG_END);
+
+                    if (toolMode == MODE_SHARING)
+                    {
+                        InstrumentSharing(bbl);
+                    }
+                    else
+                    {
+                        InstrumentCacheFilter(bbl);
+                    }
+                    break;
+                }
+
+                for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+                {
+                    Instruction(ins, v);
+                }
+                break;
+
+            default:
+                // keep the instruction counts going for the dependency record
+                BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountOnly, IARG_FAST_ANALYSIS_CALL,
+                        IARG_UINT32, numIns, IARG_REG_VALUE, mlog_reg, IARG_END);
+                break;
+        }
+    }
+}
 
-    
-    // instrument branch instructions
-    if(INS_IsBranch(ins))
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)BranchOrNot, IARG_BRANCH_TAKEN, IARG_THREAD_ID, IARG_END);
+void InitTraceWindow()
+{
+    if (KnobRoi.Value())
+    {
+        if ((KnobSkip.Value() > 0) || KnobSkipPerThread.Value())
+        {
+            cerr << "Error: -roi cannot be combined with -skip or -skip_per_thread" << endl;
+            PIN_ExitProcess(1);
+        }
 
-    // instrument register reads
-    UINT32 readRegCount = INS_MaxNumRRegs(ins);
-    for(UINT32 i=0; i<readRegCount; i++) 
+        roiTrigger = TRUE;
+        tracePhase = PHASE_FAST_FORWARD;
+        checkWindowEnd = (KnobTraceLength.Value() > 0);
+
+        IMG_AddInstrumentFunction(FindRoiMarkers, NULL);
+        return;
+    }
+
+    if (KnobSkipPerThread.Value())
     {
-        UINT32 regNum = INS_RegR(ins, i);
+        return;
+    }
 
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RegRead,
-                IARG_UINT32, regNum, IARG_UINT32, i, IARG_THREAD_ID, 
-                IARG_END);
+    if (KnobSkip.Value() > 0)
+    {
+        tracePhase = PHASE_FAST_FORWARD;
     }
 
-    // instrument register writes
-    UINT32 writeRegCount = INS_MaxNumWRegs(ins);
-    for(UINT32 i=0; i<writeRegCount; i++) 
+    checkWindowEnd = (KnobTraceLength.Value() > 0);
+}
+
+/* ===================================================================== */
+/* Clock markers                                                         */
+/* ===================================================================== */
+
+// -clock puts marker records (see trace_format.h) with the value of a clock
+// shared by all threads into every thread's trace: after its first traced
+// instruction, every -clock_interval instructions, at its pthread calls and
+// futex syscalls with -clock_at_sync, where the trace window ends and when
+// it exits. They give a coarse global order of the per-thread traces without
+// serializing the tracing. The logical clock is a global counter bumped by
+// every marker, so markers of different threads are totally ordered and the
+// order agrees with the synchronization between them. The TSC needs no
+// shared cache line, but is only comparable across cores if it is invariant
+// and synchronized.
+
+#define CLOCK_NONE 0
+
+#define NO_CLOCK_MARKER (~0ULL)
+
+KNOB<string> KnobClock(KNOB_MODE_WRITEONCE, "pintool",
+    "clock", "none", "put clock markers into the traces: none, logical (a global counter) or tsc");
+
+KNOB<UINT64> KnobClockInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "clock_interval", "1000000", "instructions of a thread between two clock markers, 0 only marks events");
+
+KNOB<BOOL> KnobClockAtSync(KNOB_MODE_WRITEONCE, "pintool",
+    "clock_at_sync", "1", "also put a clock marker at every pthread call and return and every futex syscall");
+
+UINT32 clockSource = CLOCK_NONE;
+
+BOOL clockAtSync = FALSE;
+
+struct __attribute__((aligned(64))) logical_clock_t
+{
+    UINT64 ticks;
+};
+
+logical_clock_t logicalClock;
+
+static inline UINT64 ReadClock()
+{
+    if (clockSource == CLOCK_TSC)
     {
-        UINT32 regNum = INS_RegW(ins, i);
+        UINT32 low, high;
+        __asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+        return ((UINT64)high << 32) | low;
+    }
 
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RegWrite,
-                IARG_UINT32, regNum, IARG_UINT32, i, IARG_THREAD_ID,
-                IARG_END);
+    // relaxed is enough, the increments of one variable are totally ordered
+    // consistently with happens-before
+    return __atomic_add_fetch(&logicalClock.ticks, 1, __ATOMIC_RELAXED);
+}
+
+// Append a marker after the thread's last traced instruction.
+VOID EmitClockMarker(MLOG *mlog, UINT32 reason)
+{
+    if (mlog->clockMarkers++ == 0)
+    {
+        reason = CLOCK_AT_START;
     }
 
-    // instrument memory reads and writes
-    UINT32 memOperands = INS_MemoryOperandCount(ins);
+    EncodeClockMarker(&mlog->traceBuffer[mlog->traceBufferCount], clockSource, reason, ReadClock(), mlog->insNum);
 
-    // Iterate over each memory operand of the instruction.
-    for (UINT32 memOp = 0; memOp < memOperands; memOp++) 
+    mlog->clockNextIns = (KnobClockInterval.Value() > 0) ? mlog->insNum + KnobClockInterval.Value() : NO_CLOCK_MARKER;
+
+    if (++mlog->traceBufferCount == mlog->traceBufferSize)
     {
-        if (INS_MemoryOperandIsRead(ins, memOp)) 
-        {
-            UINT32 read_size = INS_MemoryOperandSize(ins, memOp);
+        mlog->flushTraceBuffer();
+    }
+}
 
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryRead,
-                    IARG_MEMORYOP_EA, memOp, IARG_UINT32, memOp, IARG_UINT32, read_size, IARG_THREAD_ID,
-                    IARG_END);
-        }
-        if (INS_MemoryOperandIsWritten(ins, memOp)) 
-        {
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryWrite,
-                    IARG_MEMORYOP_EA, memOp, IARG_UINT32, memOp, IARG_THREAD_ID,
-                    IARG_END);
-        }
-    }    
+// Marker for an event, if -clock is on and the thread is inside the trace window.
+VOID ClockMarkerAt(MLOG *mlog, UINT32 reason)
+{
+    if ((clockSource == CLOCK_NONE) || (mlog->traceBuffer == NULL) || (tracePhase != PHASE_TRACING))
+    {
+        return;
+    }
 
-    // finalize each instruction with this function
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)EndInstruction, IARG_THREAD_ID, IARG_END);
+    if ((mlog->insNum <= mlog->traceStart) || (mlog->insNum > mlog->traceEnd))
+    {
+        return;
+    }
+
+    if ((reason == CLOCK_AT_SYNC) && ! clockAtSync)
+    {
+        return;
+    }
+
+    EmitClockMarker(mlog, reason);
+}
+
+void InitClockMarkers()
+{
+    if (KnobClock.Value() == "none")
+    {
+        return;
+    }
+
+    if (KnobClock.Value() == "logical")
+    {
+        clockSource = CLOCK_LOGICAL;
+    }
+    else if (KnobClock.Value() == "tsc")
+    {
+        clockSource = CLOCK_TSC;
+    }
+    else
+    {
+        cerr << "Error: unknown -clock value " << KnobClock.Value() << endl;
+        PIN_ExitProcess(1);
+    }
+
+    if (toolMode != MODE_TRACE)
+    {
+        cerr << "Error: -clock needs -mode trace" << endl;
+        PIN_ExitProcess(1);
+    }
+
+    // segments are cut by record count and indexed by instruction number
+    if (KnobSegmentLength.Value() > 0)
+    {
+        cerr << "Error: -clock cannot be combined with -segment_length" << endl;
+        PIN_ExitProcess(1);
+    }
+
+    clockAtSync = KnobClockAtSync.Value();
 }
 
 // called when thread starts
 void ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
 {   
     MLOG * mlog = new MLOG;
-    
-    const string traceFileName = "named_pipe_" + decstr(tid); // + decstr(getpid()) + "."
-    mlog->traceFile = fopen(traceFileName.c_str(), "ab");
 
-    if ( ! mlog->traceFile )
+    mlog->threadNum = ATOMIC::OPS::Increment<UINT64>(&nextThreadNum, 1);
+    mlog->osTid = PIN_GetTid();
+
+    mlog->traceBufferSize = KnobTraceBufferSize.Value() > 0 ? KnobTraceBufferSize.Value() : 1;
+    mlog->traceBufferCount = 0;
+
+    mlog->traceSink = NULL;
+    mlog->traceBuffer = NULL;
+    mlog->bbvWriter = NULL;
+    mlog->syncWriter = NULL;
+    mlog->missWriter = NULL;
+    mlog->profile = NULL;
+    mlog->pages = NULL;
+
+    mlog->syncDepth = 0;
+    mlog->syncCreateHolder = 0;
+    mlog->syncFutexAddr = 0;
+    mlog->syncFutexOp = 0;
+
+    // the first traced instruction gets a marker
+    mlog->clockNextIns = (clockSource != CLOCK_NONE) ? 0 : NO_CLOCK_MARKER;
+    mlog->clockMarkers = 0;
+
+    mlog->bufferFirstIns = 0;
+    mlog->segmentNumber = 0;
+    mlog->segmentRecords = 0;
+    mlog->segmentOffset = 0;
+
+    if (toolMode == MODE_TRACE)
+    {
+        if (KnobSegmentLength.Value() > 0)
+        {
+            mlog->segmentFile = SegmentFileName(mlog->threadNum, mlog->osTid, 0);
+            mlog->traceSink = OpenSinkFile(mlog->segmentFile, FALSE, mlog->traceBufferSize * sizeof(trace_instr_format_t));
+        }
+        else
+        {
+            mlog->traceSink = OpenSink("trace", mlog->threadNum, mlog->osTid, mlog->traceBufferSize * sizeof(trace_instr_format_t));
+        }
+        mlog->traceBuffer = reinterpret_cast<trace_instr_format_t*>(mlog->traceSink->openBuffer());
+    }
+    else if (toolMode == MODE_BBV)
+    {
+        mlog->bbvWriter = OpenStreamWriter("bbv", mlog->threadNum, mlog->osTid);
+        mlog->bbvIntervalIns = 0;
+        mlog->bbvIntervals = 0;
+    }
+    else if (toolMode == MODE_CACHE_FILTER)
+    {
+        StartCacheFilter(mlog);
+    }
+    else if (toolMode == MODE_PROFILE)
+    {
+        StartProfile(mlog);
+    }
+    else if (toolMode == MODE_PAGES)
     {
-        cerr << "Error: could not open output trace file." << endl;
-        exit(1);
+        StartPages(mlog);
     }
 
     mlog->insNum = 0;            
 
+    mlog->pendingCount = 0;
+
+    if (KnobSkipPerThread.Value())
+    {
+        mlog->traceStart = KnobSkip.Value();
+        mlog->traceEnd = KnobTraceLength.Value() > 0 ? KnobSkip.Value() + KnobTraceLength.Value() : NO_WINDOW_END;
+    }
+    else
+    {
+        // the global window is enforced by switching the instrumentation
+        mlog->traceStart = 0;
+        mlog->traceEnd = NO_WINDOW_END;
+    }
+
     PIN_MutexInit(&mlog->threadLockMutex);
 
     mlog->threadDependencyNode = NULL;
+    mlog->threadDependencyTail = NULL;
 
     mlog->child_thread_record_root_node = NULL;
+    mlog->child_thread_record_tail_node = NULL;
+    mlog->child_thread_record_pending_node = NULL;
 
     // A thread will need to look up its MLOG, so save pointer in TLS    
     if (PIN_SetThreadData(mlog_key, mlog, tid) == FALSE)
@@ -535,40 +4407,120 @@ void ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
         PIN_ExitProcess(1);
     }
 
-    PIN_GetLock(&global_lock, tid);
+    // and in the tool register for the analysis routines
+    PIN_SetContextReg(ctxt, mlog_reg, (ADDRINT)mlog);
 
-    // Set the parent thread ID
-    if (tid != 0)
-    {
-        mlog->parentThreadID = queryThreadMapDB(PIN_GetParentTid());
+    // Set the parent thread, it registered itself before creating us
+    mlog->parentMlog = (tid != 0) ? queryThreadMapDB(PIN_GetParentTid()) : NULL;
 
-        MLOG* parentMlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, mlog->parentThreadID));
-        parentMlog->popSpaceInThreadCreation(mlog->parentThreadID, tid);
+    if (mlog->parentMlog != NULL)
+    {
+        mlog->parentThreadID = mlog->parentMlog->threadNum;
+        mlog->parentMlog->popSpaceInThreadCreation(mlog->parentThreadID, mlog->threadNum);
     }
     else
     {
         mlog->parentThreadID = 0;
     }
 
-    insertThreadMapDB(PIN_GetTid(), tid);
+    insertThreadMapDB(mlog->osTid, mlog);
 
-    PIN_ReleaseLock(&global_lock);
+    if (dependencyJsonl)
+    {
+        std::ostringstream line;
+        line << "{\"event\":\"start\",\"thread\":" << mlog->threadNum;
+        if (mlog->parentMlog != NULL)
+        {
+            line << ",\"parent\":" << mlog->parentThreadID
+                 << ",\"start\":" << mlog->parentMlog->insNum;
+        }
+        line << ",\"pin_tid\":" << tid << ",\"os_tid\":" << mlog->osTid << "}";
+
+        WriteDependencyLine(line.str());
+    }
+
+    if (KnobSync.Value())
+    {
+        if (mlog->parentMlog != NULL)
+        {
+            StartSyncStream(mlog, mlog->parentMlog->threadNum, mlog->parentMlog->insNum);
+        }
+        else
+        {
+            StartSyncStream(mlog, 0, 0);
+        }
+    }
 }
 
-// Called when thread finishes
-void ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
-{       
-    MLOG * mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, tid));
+void CloseThreadTrace(MLOG *mlog, THREADID tid)
+{
+    if (mlog->bbvWriter != NULL)
+    {
+        FinishBbv(mlog, tid);
+    }
+
+    if (mlog->syncWriter != NULL)
+    {
+        FinishSyncStream(mlog);
+    }
+
+    if (mlog->missWriter != NULL)
+    {
+        FinishCacheFilter(mlog, tid);
+    }
+
+    if (mlog->profile != NULL)
+    {
+        FinishProfile(mlog);
+    }
+
+    if (mlog->pages != NULL)
+    {
+        FinishPages(mlog);
+    }
+
+    if (mlog->traceSink != NULL)
+    {
+        ClockMarkerAt(mlog, CLOCK_AT_END);
+        mlog->closeTrace();
+    }
+}
+
+void FinishThread(MLOG *mlog, THREADID tid)
+{
+    volatile MLOG * parentMlog = mlog->parentMlog;
 
-    volatile MLOG * parentMlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, mlog->parentThreadID));
+    UINT64 terminateTime = (parentMlog != NULL) ? parentMlog->insNum : 0;
 
-    if (tid != 0)
+    if (parentMlog != NULL)
     {
-        updateThreadDependencyDB(tid, parentMlog->insNum);
-        updateThreadDependencyDBTerminateInsCount(tid, mlog->insNum);
+        updateThreadDependencyDB(mlog->threadNum, terminateTime);
+        updateThreadDependencyDBTerminateInsCount(mlog->threadNum, mlog->insNum);
     }   
+
+    if (dependencyJsonl)
+    {
+        std::ostringstream line;
+        line << "{\"event\":\"finish\",\"thread\":" << mlog->threadNum;
+        if (parentMlog != NULL)
+        {
+            line << ",\"parent\":" << mlog->parentThreadID
+                 << ",\"terminate\":" << terminateTime;
+        }
+        line << ",\"instructions\":" << mlog->insNum << "}";
+
+        WriteDependencyLine(line.str());
+    }
     
-    fclose(mlog->traceFile);
+    CloseThreadTrace(mlog, tid);
+}
+
+// Called when thread finishes
+void ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{       
+    MLOG * mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, tid));
+
+    FinishThread(mlog, tid);
 
     // delete mlog;    
 }
@@ -583,46 +4535,120 @@ void Fini(INT32 code, VOID *v)
 
     cout << "------------------------------------------------------------------------------------------------------" << endl;
 
-    threadDependency << "======================================================================================================" << endl;
+    if ( ! dependencyJsonl)
+    {
+        threadDependency << "======================================================================================================" << endl;
 
-    threadDependency << "Child Thread    Parent Thread    Thread Start    Thread Terminate    #Instructions Run" << endl;
+        threadDependency << "Child Thread    Parent Thread    Thread Start    Thread Terminate    #Instructions Run" << endl;
 
-    threadDependency << "------------------------------------------------------------------------------------------------------" << endl;
+        threadDependency << "------------------------------------------------------------------------------------------------------" << endl;
+    }
     
-    map<UINT64, threadDependencyRecord>::iterator itR;
-    for (itR = threadDependencyDB.begin(); itR != threadDependencyDB.end(); ++itR) {
-        cout << setw(12) << itR->first << "    " 
-        << setw(13) << itR->second.parentThread << "    "
-        << setw(12) << itR->second.startTime << "    "
-        << setw(16) << itR->second.terminateTime  << "    "
-        << setw(17) << itR->second.insCount << endl;
-
-        threadDependency << setw(12) << itR->first << "    " 
-        << setw(13) << itR->second.parentThread << "    "        
-        << setw(12) << itR->second.startTime << "    "
-        << setw(16) << itR->second.terminateTime  << "    "
-        << setw(17) << itR->second.insCount << endl;
+    for (UINT64 child = 0; child < nextThreadNum; child++) {
+        const threadDependencyRecord *r = threadDependencyDB.find(child);
+
+        if ((r == NULL) || ! r->valid)
+        {
+            continue;
+        }
+
+        cout << setw(12) << child << "    " 
+        << setw(13) << r->parentThread << "    "
+        << setw(12) << r->startTime << "    "
+        << setw(16) << r->terminateTime  << "    "
+        << setw(17) << r->insCount << endl;
+
+        if ( ! dependencyJsonl)
+        {
+            threadDependency << setw(12) << child << "    " 
+            << setw(13) << r->parentThread << "    "        
+            << setw(12) << r->startTime << "    "
+            << setw(16) << r->terminateTime  << "    "
+            << setw(17) << r->insCount << endl;
+        }
     }    
 
-    threadDependency << "======================================================================================================" << endl;
+    UINT64 mainInsNum = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, 0))->insNum;
 
-    threadDependency << "Thread 0 instruction count " << static_cast<MLOG*>(PIN_GetThreadData(mlog_key, 0))->insNum << endl;
+    if (dependencyJsonl)
+    {
+        std::ostringstream line;
+        line << "{\"event\":\"end\",\"threads\":" << nextThreadNum
+             << ",\"main_instructions\":" << mainInsNum << "}";
 
-    threadDependency << "======================================================================================================" << endl;
+        WriteDependencyLine(line.str());
+    }
+    else
+    {
+        threadDependency << "======================================================================================================" << endl;
 
-    threadDependency << "The end!" << endl;  
+        threadDependency << "Thread 0 instruction count " << mainInsNum << endl;
 
-    threadDependency.close();
+        threadDependency << "======================================================================================================" << endl;
 
-    map<UINT64, UINT64>::iterator itr;
+        threadDependency << "The end!" << endl;  
+    }
+
+    threadDependency.close();
 
     cout << "======================================================================================================" << endl;
 
-    cout << "Thread 0 instruction count " << static_cast<MLOG*>(PIN_GetThreadData(mlog_key, 0))->insNum << endl;
+    cout << "Thread 0 instruction count " << mainInsNum << endl;
 
     cout << "======================================================================================================" << endl;
 
     cout << "The end!" << endl;  
+
+    if (toolMode == MODE_SHARING)
+    {
+        WriteSharingReport();
+    }
+
+    if (toolMode == MODE_CACHE_FILTER)
+    {
+        WriteCacheFilterSummary();
+    }
+
+    if (toolMode == MODE_PROFILE)
+    {
+        WriteProfileSummary();
+    }
+
+    if (toolMode == MODE_PAGES)
+    {
+        WritePagesReport();
+    }
+
+    if ( ! asyncWriters.empty())
+    {
+        WriteAsyncWriterStats();
+    }
+}
+
+// Called in each thread when the tool detaches after the trace window
+void ThreadDetach(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    MLOG * mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, tid));
+
+    FinishThread(mlog, tid);
+}
+
+// Called once all threads are detached, Fini will not run after a detach
+void Detach(VOID *v)
+{
+    if ((sinkKind == SINK_XZ) || (sinkKind == SINK_ZSTD))
+    {
+        StopCompressionWorkers(NULL);
+    }
+
+    StopAsyncWriters(NULL);
+
+    if (toolMode == MODE_PROFILE)
+    {
+        StopProfileSampler(NULL);
+    }
+
+    Fini(0, NULL);
 }
 
 /* ===================================================================== */
@@ -653,13 +4679,61 @@ int main(int argc, char * argv[])
         PIN_ExitProcess(1);
     }
 
+    // Claim a tool register for the MLOG pointer.
+    mlog_reg = PIN_ClaimToolRegister();
+    if ( ! REG_valid(mlog_reg))
+    {
+        cerr << "Cannot allocate a scratch register" << endl;
+        PIN_ExitProcess(1);
+    }
+
     cout << "Size of MLOG = " << sizeof(MLOG) << endl;
 
     // open the thread dependency file
     const string threadDependencyFileName = KnobOutputFile.Value();
     threadDependency.open(threadDependencyFileName.c_str());
 
-    PIN_InitLock(&global_lock);
+    if (KnobDependencyFormat.Value() == "text")
+    {
+        dependencyJsonl = FALSE;
+    }
+    else if (KnobDependencyFormat.Value() != "jsonl")
+    {
+        cerr << "Error: unknown -dep_format value " << KnobDependencyFormat.Value() << endl;
+        PIN_ExitProcess(1);
+    }
+
+    PIN_MutexInit(&dependency_lock);
+
+    InitSinks();
+
+    InitSegments();
+
+    toolMode = ParseToolMode(KnobMode.Value());
+
+    if (toolMode == MODE_BBV)
+    {
+        PIN_InitLock(&bbv_lock);
+
+        const string bbvThreadsFileName = RunFileName("bbv_threads.txt");
+        bbvThreads.open(bbvThreadsFileName.c_str());
+    }
+    else if (toolMode == MODE_SHARING)
+    {
+        InitSharing();
+    }
+    else if (toolMode == MODE_CACHE_FILTER)
+    {
+        InitCacheFilter();
+    }
+    else if (toolMode == MODE_PROFILE)
+    {
+        InitProfile();
+    }
+    else if (toolMode == MODE_PAGES)
+    {
+        InitPages();
+    }
 
     // Register ThreadStart to be called when a thread starts.
     PIN_AddThreadStartFunction(ThreadStart, NULL);
@@ -670,8 +4744,24 @@ int main(int argc, char * argv[])
     // Register Fini to be called when the application exits.
     PIN_AddFiniFunction(Fini, NULL);
 
+    InitClockMarkers();
+
+    if (KnobSync.Value() || clockAtSync)
+    {
+        // routines and syscalls recorded in the sync streams or marked in the traces
+        IMG_AddInstrumentFunction(InstrumentSyncRoutines, NULL);
+        PIN_AddSyscallEntryFunction(SyncSyscallEntry, NULL);
+        PIN_AddSyscallExitFunction(SyncSyscallExit, NULL);
+    }
+
+    // Register the callbacks that finish the traces when the tool detaches.
+    PIN_AddThreadDetachFunction(ThreadDetach, NULL);
+    PIN_AddDetachFunction(Detach, NULL);
+
+    InitTraceWindow();
+
     // routines to trace instructions
-    INS_AddInstrumentFunction(Instruction, NULL);
+    TRACE_AddInstrumentFunction(Trace, NULL);
 
     // Start the program, never returns
     PIN_StartProgram();